@@ -0,0 +1,121 @@
+#include "common/basename.h"
+#include "common/error.h"
+#include "fastscale.h"
+
+#include <libavutil/frame.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DEFAULT_ITERATIONS 2000
+
+struct bench_case {
+  enum AVPixelFormat format;
+  int src_width;
+  int src_height;
+  int ratio;
+};
+
+static const struct bench_case bench_cases[] = {
+  { AV_PIX_FMT_YUV420P, 720, 400, 2 },
+  { AV_PIX_FMT_YUV420P, 720, 400, 4 },
+  { AV_PIX_FMT_NV12, 720, 400, 2 },
+  { AV_PIX_FMT_NV12, 720, 400, 4 },
+  { AV_PIX_FMT_YUV420P, 1920, 1080, 2 },
+};
+
+static AVFrame* allocate_bench_frame(enum AVPixelFormat format, int width, int height) {
+  AVFrame* frame = av_frame_alloc();
+  if (!frame) {
+    throw_error("Error allocating a video frame", -1);
+  }
+
+  frame->format = format;
+  frame->width = width;
+  frame->height = height;
+
+  int status = av_frame_get_buffer(frame, 0);
+  if (status < 0) {
+    throw_error("Error allocating a video buffer", status);
+  }
+  return frame;
+}
+
+static void fill_bench_frame(AVFrame* frame) {
+  int planes = frame->format == AV_PIX_FMT_NV12 ? 2 : 3;
+  for (int plane = 0; plane < planes; plane++) {
+    int rows = plane ? frame->height / 2 : frame->height;
+    for (int y = 0; y < rows; y++) {
+      for (int x = 0; x < frame->linesize[plane]; x++) {
+	frame->data[plane][y * frame->linesize[plane] + x] = (uint8_t)rand();
+      }
+    }
+  }
+}
+
+static double run_sws(struct SwsContext* sws_context, AVFrame* src, AVFrame* dst, int iterations) {
+  int64_t start = av_gettime_relative();
+  for (int i = 0; i < iterations; i++) {
+    sws_scale(sws_context, (const uint8_t* const*)src->data, src->linesize, 0, src->height,
+	      dst->data, dst->linesize);
+  }
+  return (double)(av_gettime_relative() - start) / iterations;
+}
+
+static double run_fastscale(fastscale_context_t* fastscale_context, AVFrame* src, AVFrame* dst,
+			    int ratio, int iterations) {
+  int64_t start = av_gettime_relative();
+  for (int i = 0; i < iterations; i++) {
+    fastscale_frame(fastscale_context, src, dst, ratio);
+  }
+  return (double)(av_gettime_relative() - start) / iterations;
+}
+
+int main(int argc, char* argv[]) {
+  set_basename(argv[0]);
+
+  int iterations = argc > 1 ? (int)strtol(argv[1], NULL, 10) : DEFAULT_ITERATIONS;
+  if (iterations <= 0) {
+    throw_error("Iteration count must be positive.", -1);
+  }
+
+  fastscale_context_t* fastscale_context = NULL;
+  fastscale_open(&fastscale_context);
+
+  printf("fastscale kernels: %s, %d iterations\n", fastscale_get_kernel_name(), iterations);
+  printf("%-8s %-10s %-6s %12s %12s %8s\n", "format", "source", "ratio", "sws us", "fast us",
+	 "speedup");
+
+  for (size_t i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++) {
+    const struct bench_case* bench = &bench_cases[i];
+    int dst_width = bench->src_width / bench->ratio;
+    int dst_height = bench->src_height / bench->ratio;
+
+    AVFrame* src = allocate_bench_frame(bench->format, bench->src_width, bench->src_height);
+    AVFrame* dst = allocate_bench_frame(bench->format, dst_width, dst_height);
+    fill_bench_frame(src);
+
+    struct SwsContext* sws_context = sws_getContext(bench->src_width, bench->src_height,
+						    bench->format, dst_width, dst_height,
+						    bench->format, SWS_BILINEAR, NULL, NULL, NULL);
+    if (!sws_context) {
+      throw_error("Could not allocate the scaler.", -1);
+    }
+
+    double sws_time = run_sws(sws_context, src, dst, iterations);
+    double fast_time = run_fastscale(fastscale_context, src, dst, bench->ratio, iterations);
+
+    printf("%-8s %4dx%-5d %-6d %12.2f %12.2f %7.2fx\n",
+	   bench->format == AV_PIX_FMT_NV12 ? "nv12" : "yuv420p", bench->src_width,
+	   bench->src_height, bench->ratio, sws_time, fast_time, sws_time / fast_time);
+
+    sws_freeContext(sws_context);
+    av_frame_free(&src);
+    av_frame_free(&dst);
+  }
+
+  fastscale_close(&fastscale_context);
+  return 0;
+}
@@ -0,0 +1,301 @@
+#include "batch.h"
+#include "cache.h"
+#include "checkpoint.h"
+#include "decoder.h"
+#include "job.h"
+#include "scheduler.h"
+#include "common/error.h"
+
+#include <libavutil/time.h>
+
+#include <limits.h>
+#include <math.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BATCH_PRESET_SIZE 32
+
+struct batch_job {
+  int index;
+  char input_filename[PATH_MAX];
+  char output_filename[PATH_MAX];
+  char preset[BATCH_PRESET_SIZE];
+  float start_ts;
+  float end_ts;
+  struct encoder_options encoder_options;
+
+  float chunk_length;
+  scheduler_context_t* scheduler_context;
+
+  int nb_chunks;
+  int remaining_chunks;
+  float* boundaries; // nb_chunks + 1 source timestamps
+
+  int64_t start_time;
+  int64_t end_time;
+  int64_t work_time; // summed over the workers that ran its chunks
+  int64_t first_frame_time; // of the first chunk, -1 until it ran
+  int failed; // set by whatever part of the job failed first, no output is left then
+};
+
+struct batch_chunk {
+  struct batch_job* job;
+  int index;
+};
+
+static int64_t elapsed_since(int64_t start_time) {
+  return av_gettime_relative() - start_time;
+}
+
+static void parse_manifest(const char* manifest_filename, const struct encoder_options* encoder_options,
+			   struct batch_job** jobs, int* nb_jobs) {
+  char line[3 * PATH_MAX];
+  char message[128];
+  int capacity = 0;
+  int line_number = 0;
+
+  FILE* file = fopen(manifest_filename, "r");
+  if (!file) {
+    throw_error("Could not open the batch manifest.", -1);
+  }
+
+  *jobs = NULL;
+  *nb_jobs = 0;
+
+  while (fgets(line, sizeof(line), file)) {
+    struct batch_job job;
+    char* text = line + strspn(line, " \t");
+
+    line_number++;
+    if (*text == '#' || *text == '\n' || *text == '\0') {
+      continue;
+    }
+
+    memset(&job, 0, sizeof(job));
+    snprintf(job.preset, sizeof(job.preset), "%s", encoder_options->preset);
+
+    int fields = sscanf(text, "%4095s %f %f %4095s %31s", job.input_filename, &job.start_ts,
+			&job.end_ts, job.output_filename, job.preset);
+    if (fields < 4 || job.start_ts > job.end_ts) {
+      snprintf(message, sizeof(message), "Invalid batch manifest entry on line %d.", line_number);
+      throw_error(message, -1);
+    }
+
+    if (*nb_jobs == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      *jobs = (struct batch_job*)realloc(*jobs, capacity * sizeof(struct batch_job));
+      if (!*jobs) {
+	throw_error("Batch job list allocation failed.", -1);
+      }
+    }
+
+    job.index = *nb_jobs;
+    job.first_frame_time = -1;
+    (*jobs)[(*nb_jobs)++] = job;
+  }
+
+  fclose(file);
+
+  // Pointers into the job list are only taken once it stopped growing
+  for (int i = 0; i < *nb_jobs; i++) {
+    struct batch_job* job = &(*jobs)[i];
+    job->encoder_options = *encoder_options;
+    job->encoder_options.preset = job->preset;
+  }
+}
+
+/* Chunk boundaries land on keyframes so no chunk decodes frames that belong to its neighbour */
+static void split_job(struct batch_job* job) {
+  decoder_context_t* decoder_context = NULL;
+  int capacity = 2 + (int)ceilf((job->end_ts - job->start_ts) / job->chunk_length);
+
+  job->boundaries = (float*)malloc(capacity * sizeof(float));
+  if (!job->boundaries) {
+    throw_error("Batch chunk list allocation failed.", -1);
+  }
+
+  job->nb_chunks = 0;
+  job->boundaries[0] = job->start_ts;
+
+  if (job->end_ts - job->start_ts > job->chunk_length) {
+    decoder_open(&decoder_context, job->input_filename, job->start_ts, job->end_ts);
+
+    for (int i = 1; i < capacity - 1; i++) {
+      float target_ts = job->start_ts + i * job->chunk_length;
+
+      // Fold a short tail into the last chunk
+      if (target_ts > job->end_ts - job->chunk_length / 2) {
+	break;
+      }
+
+      float keyframe_ts = decoder_find_keyframe(decoder_context, target_ts);
+      if (keyframe_ts <= job->boundaries[job->nb_chunks] || keyframe_ts >= job->end_ts) {
+	continue;
+      }
+      job->boundaries[++job->nb_chunks] = keyframe_ts;
+    }
+
+    decoder_close(&decoder_context);
+  }
+
+  job->boundaries[++job->nb_chunks] = job->end_ts;
+  job->remaining_chunks = job->nb_chunks;
+}
+
+static void finish_job(struct batch_job* job) {
+  jmp_buf catch_point;
+
+  if (job->nb_chunks > 1) {
+    if (!job->failed) {
+      if (setjmp(catch_point) == 0) {
+	set_error_catch(&catch_point);
+	checkpoint_join_output(job->output_filename, job->nb_chunks, job->output_filename);
+	set_error_catch(NULL);
+      } else {
+	__sync_fetch_and_or(&job->failed, 1);
+	unlink(job->output_filename);
+      }
+    }
+    checkpoint_remove_segments(job->output_filename, job->nb_chunks);
+  }
+  job->end_time = av_gettime_relative();
+}
+
+static void run_chunk(void* argument) {
+  struct batch_chunk* chunk = (struct batch_chunk*)argument;
+  struct batch_job* job = chunk->job;
+  struct job_segment segment;
+  struct job_stats stats;
+  char filename[PATH_MAX];
+  int64_t start_time = av_gettime_relative();
+
+  float start_ts = job->boundaries[chunk->index];
+  float end_ts = job->boundaries[chunk->index + 1];
+
+  job_init_segment(&segment, job->input_filename, start_ts, end_ts);
+  segment.origin_ts = job->start_ts;
+  segment.end_exclusive = chunk->index < job->nb_chunks - 1;
+  segment.encoder_options = &job->encoder_options;
+  segment.stats = &stats;
+  // Chunks run out of order, their audio starts on the whole frame grid where the previous chunk's
+  // stopped, which only depends on the boundary between them
+  segment.samples_count = job_get_audio_boundary(job->start_ts, start_ts);
+
+  if (job->nb_chunks > 1) {
+    checkpoint_get_segment_filename(job->output_filename, chunk->index, filename, sizeof(filename));
+  } else {
+    cache_get_temp_filename(job->output_filename, filename, sizeof(filename));
+  }
+
+  // A failure ends this job, not the batch: the others go on and the report tells which failed
+  if (!job->failed) {
+    jmp_buf catch_point;
+    if (setjmp(catch_point) == 0) {
+      set_error_catch(&catch_point);
+      job_transcode(&segment, filename);
+      if (job->nb_chunks == 1 && rename(filename, job->output_filename) < 0) {
+	throw_error("Could not move the output file into place.", -1);
+      }
+      set_error_catch(NULL);
+
+      if (chunk->index == 0) {
+	job->first_frame_time = stats.first_frame_time;
+      }
+    } else {
+      __sync_fetch_and_or(&job->failed, 1);
+      unlink(filename);
+    }
+  }
+  __sync_fetch_and_add(&job->work_time, elapsed_since(start_time));
+  if (__sync_sub_and_fetch(&job->remaining_chunks, 1) == 0) {
+    finish_job(job);
+  }
+  free(chunk);
+}
+
+static void plan_job(void* argument) {
+  struct batch_job* job = (struct batch_job*)argument;
+  int64_t start_time = av_gettime_relative();
+
+  jmp_buf catch_point;
+
+  job->start_time = start_time;
+  if (setjmp(catch_point) == 0) {
+    set_error_catch(&catch_point);
+    split_job(job);
+    set_error_catch(NULL);
+  } else {
+    job->failed = 1;
+    job->nb_chunks = 0;
+    job->end_time = av_gettime_relative();
+  }
+  __sync_fetch_and_add(&job->work_time, elapsed_since(start_time));
+
+  // Pushed onto this worker's deque, the rest of the pool steals from the far end
+  for (int i = job->nb_chunks - 1; i >= 0; i--) {
+    struct batch_chunk* chunk = (struct batch_chunk*)malloc(sizeof(struct batch_chunk));
+    if (!chunk) {
+      throw_error("Batch chunk allocation failed.", -1);
+    }
+    chunk->job = job;
+    chunk->index = i;
+    scheduler_submit(job->scheduler_context, run_chunk, chunk);
+  }
+}
+
+static void print_report(struct batch_job* jobs, int nb_jobs, int nb_workers, int64_t wall_time) {
+  int64_t work_time = 0;
+  int nb_failed = 0;
+
+  printf("%-5s %-7s %10s %10s %10s  %s\n", "job", "chunks", "wall s", "work s", "1st frm ms",
+	 "output");
+  for (int i = 0; i < nb_jobs; i++) {
+    struct batch_job* job = &jobs[i];
+    printf("%-5d %-7d %10.2f %10.2f %10.1f  %s%s\n", job->index, job->nb_chunks,
+	   (job->end_time - job->start_time) / 1e6, job->work_time / 1e6,
+	   job->first_frame_time / 1e3, job->failed ? "FAILED " : "", job->output_filename);
+    work_time += job->work_time;
+    nb_failed += job->failed;
+  }
+
+  printf("batch: %d jobs, %d failed, %d workers, %.2f s wall, %.1f%% utilization\n", nb_jobs, nb_workers,
+	 nb_failed, wall_time / 1e6, wall_time > 0 ? 100.0 * work_time / ((double)wall_time * nb_workers) : 0.0);
+}
+
+int batch_run(const char* manifest_filename, int nb_workers, float chunk_length,
+	      const struct encoder_options* encoder_options) {
+  struct batch_job* jobs = NULL;
+  int nb_jobs = 0;
+  int nb_failed = 0;
+  scheduler_context_t* scheduler_context = NULL;
+
+  if (chunk_length <= 0) {
+    throw_error("Batch chunk length must be positive.", -1);
+  }
+
+  parse_manifest(manifest_filename, encoder_options, &jobs, &nb_jobs);
+
+  int64_t start_time = av_gettime_relative();
+  scheduler_open(&scheduler_context, nb_workers);
+
+  for (int i = 0; i < nb_jobs; i++) {
+    jobs[i].chunk_length = chunk_length;
+    jobs[i].scheduler_context = scheduler_context;
+    scheduler_submit(scheduler_context, plan_job, &jobs[i]);
+  }
+
+  scheduler_wait(scheduler_context);
+  scheduler_close(&scheduler_context);
+
+  print_report(jobs, nb_jobs, nb_workers, elapsed_since(start_time));
+
+  for (int i = 0; i < nb_jobs; i++) {
+    nb_failed += jobs[i].failed;
+    free(jobs[i].boundaries);
+  }
+  free(jobs);
+  return nb_failed;
+}
@@ -0,0 +1,16 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include "encoder.h"
+
+/*
+ * Runs every job of the manifest on a pool of nb_workers threads. Each line of the manifest
+ * holds "INPUT START END OUTPUT [PRESET]", blank lines and lines starting with '#' are skipped.
+ * Jobs longer than chunk_length seconds are split at keyframes into chunks that idle workers
+ * steal, the chunks of a job are joined once the last one is done. A job that fails leaves no
+ * output and the others carry on, returns the number of failed jobs.
+ */
+extern int batch_run(const char* manifest_filename, int nb_workers, float chunk_length,
+		     const struct encoder_options* encoder_options);
+
+#endif
@@ -0,0 +1,456 @@
+#define _GNU_SOURCE // copy_file_range
+
+#include "cache.h"
+#include "common/error.h"
+
+#include <libavformat/avformat.h>
+#include <libavutil/sha.h>
+#include <libavutil/mem.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_FINGERPRINT_BUFFER_SIZE (1 << 20)
+#define CACHE_COPY_BUFFER_SIZE (1 << 16)
+#define CACHE_STALE_TEMP_AGE (24 * 60 * 60)
+#define CACHE_STALE_FINGERPRINT_AGE (30 * 24 * 60 * 60)
+#define CACHE_TEMP_PREFIX ".tmp-"
+#define CACHE_FINGERPRINT_PREFIX ".fingerprint-"
+
+typedef struct cache_context {
+  char directory[PATH_MAX];
+  int64_t max_size;
+  int fingerprint;
+} cache_context_t;
+
+struct cache_entry {
+  char name[CACHE_KEY_SIZE];
+  int64_t size;
+  struct timespec mtime;
+};
+
+static void hash_string(struct AVSHA* sha, const char* value) {
+  av_sha_update(sha, (const uint8_t*)value, strlen(value) + 1);
+}
+
+static void get_entry_filename(cache_context_t* cache_context, const char* name, char* buffer,
+			       size_t size) {
+  snprintf(buffer, size, "%s/%s", cache_context->directory, name);
+}
+
+static int next_temp_id() {
+  static int temp_id = 0;
+  return __sync_fetch_and_add(&temp_id, 1);
+}
+
+static void get_directory_temp_filename(const char* directory, const char* name, char* buffer,
+					size_t size) {
+  snprintf(buffer, size, "%s/" CACHE_TEMP_PREFIX "%ld-%d-%s", directory, (long)getpid(),
+	   next_temp_id(), name);
+}
+
+static void format_digest(const uint8_t* digest, char* key) {
+  for (int i = 0; i < 32; i++) {
+    sprintf(key + 2 * i, "%02x", digest[i]);
+  }
+}
+
+static struct AVSHA* allocate_sha() {
+  struct AVSHA* sha = av_sha_alloc();
+  if (!sha) {
+    throw_error("Cache key hash allocation failed.", -1);
+  }
+  av_sha_init(sha, 256);
+  return sha;
+}
+
+/* Where the file is and which version of it */
+static void hash_input_location(struct AVSHA* sha, const char* filename, const struct stat* info) {
+  char buffer[PATH_MAX + 64];
+
+  snprintf(buffer, sizeof(buffer), "size=%lld", (long long)info->st_size);
+  hash_string(sha, buffer);
+
+  if (!realpath(filename, buffer)) {
+    throw_error("Could not resolve the input file path.", -1);
+  }
+  hash_string(sha, buffer);
+
+  snprintf(buffer, sizeof(buffer), "mtime=%lld.%09ld", (long long)info->st_mtim.tv_sec,
+	   info->st_mtim.tv_nsec);
+  hash_string(sha, buffer);
+}
+
+static void hash_whole_file(const char* filename, char* fingerprint) {
+  uint8_t digest[32];
+  ssize_t bytes = 0;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    throw_error("Could not open the input file for fingerprinting.", -1);
+  }
+
+  uint8_t* buffer = (uint8_t*)malloc(CACHE_FINGERPRINT_BUFFER_SIZE);
+  if (!buffer) {
+    throw_error("Cache fingerprint buffer allocation failed.", -1);
+  }
+
+  struct AVSHA* sha = allocate_sha();
+  while ((bytes = read(fd, buffer, CACHE_FINGERPRINT_BUFFER_SIZE)) > 0) {
+    av_sha_update(sha, buffer, (unsigned int)bytes);
+  }
+  if (bytes < 0) {
+    throw_error("Could not read the input file for fingerprinting.", -1);
+  }
+  av_sha_final(sha, digest);
+  av_free(sha);
+
+  free(buffer);
+  close(fd);
+
+  format_digest(digest, fingerprint);
+}
+
+static int read_fingerprint(const char* filename, char* fingerprint) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+
+  ssize_t bytes = read(fd, fingerprint, CACHE_KEY_SIZE - 1);
+  close(fd);
+  if (bytes != CACHE_KEY_SIZE - 1) {
+    return 0;
+  }
+
+  fingerprint[CACHE_KEY_SIZE - 1] = 0;
+  return strspn(fingerprint, "0123456789abcdef") == CACHE_KEY_SIZE - 1;
+}
+
+/* Best effort, without the memo the next run hashes the file again */
+static void write_fingerprint(cache_context_t* cache_context, const char* filename,
+			      const char* fingerprint) {
+  char temp_filename[PATH_MAX];
+
+  get_directory_temp_filename(cache_context->directory, "fingerprint", temp_filename,
+			      sizeof(temp_filename));
+
+  int fd = open(temp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return;
+  }
+
+  ssize_t bytes = write(fd, fingerprint, CACHE_KEY_SIZE - 1);
+  if (close(fd) < 0 || bytes != CACHE_KEY_SIZE - 1 || rename(temp_filename, filename) < 0) {
+    unlink(temp_filename);
+  }
+}
+
+/* Content fingerprint: a hash of the whole file, computed once per path, size and mtime and
+   memoized in the cache directory */
+static void get_content_fingerprint(cache_context_t* cache_context, const char* filename,
+				    const struct stat* info, char* fingerprint) {
+  char memo_name[CACHE_KEY_SIZE];
+  char memo_filename[PATH_MAX];
+  uint8_t digest[32];
+  struct stat after;
+
+  struct AVSHA* sha = allocate_sha();
+  hash_input_location(sha, filename, info);
+  av_sha_final(sha, digest);
+  av_free(sha);
+  format_digest(digest, memo_name);
+
+  snprintf(memo_filename, sizeof(memo_filename), "%s/" CACHE_FINGERPRINT_PREFIX "%s",
+	   cache_context->directory, memo_name);
+  if (read_fingerprint(memo_filename, fingerprint)) {
+    // Memos in use are kept, see evict_cache_entries
+    utimensat(AT_FDCWD, memo_filename, NULL, 0);
+    return;
+  }
+
+  hash_whole_file(filename, fingerprint);
+
+  // A file written to while it was hashed is hashed again next time
+  if (stat(filename, &after) == 0 && after.st_size == info->st_size &&
+      after.st_mtim.tv_sec == info->st_mtim.tv_sec && after.st_mtim.tv_nsec == info->st_mtim.tv_nsec) {
+    write_fingerprint(cache_context, memo_filename, fingerprint);
+  }
+}
+
+static void hash_input_identity(cache_context_t* cache_context, struct AVSHA* sha, const char* filename) {
+  char fingerprint[CACHE_KEY_SIZE];
+  struct stat info;
+
+  if (stat(filename, &info) < 0) {
+    throw_error("Could not stat the input file.", -1);
+  }
+
+  if (cache_context->fingerprint) {
+    get_content_fingerprint(cache_context, filename, &info, fingerprint);
+    hash_string(sha, "content=");
+    hash_string(sha, fingerprint);
+    return;
+  }
+
+  hash_input_location(sha, filename, &info);
+}
+
+/* Shares extents where the filesystem can, copies in the kernel otherwise, read/write as a last
+   resort. Either way the copy is its own inode, changing one never touches the other. */
+static ssize_t copy_file_data(int src_fd, int dst_fd) {
+  char buffer[CACHE_COPY_BUFFER_SIZE];
+  struct stat info;
+  ssize_t bytes = 0;
+
+  if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+    return 0;
+  }
+
+  if (fstat(src_fd, &info) < 0) {
+    return -1;
+  }
+  // Offsets move with every chunk, the fallback picks up where an unsupported one stopped
+  for (off_t remaining = info.st_size; remaining > 0; remaining -= bytes) {
+    bytes = copy_file_range(src_fd, NULL, dst_fd, NULL, (size_t)remaining, 0);
+    if (bytes <= 0) {
+      break;
+    }
+  }
+
+  while ((bytes = read(src_fd, buffer, sizeof(buffer))) > 0) {
+    if (write(dst_fd, buffer, bytes) != bytes) {
+      return -1;
+    }
+  }
+  return bytes;
+}
+
+static int copy_file(const char* src_filename, const char* dst_filename) {
+  int src_fd = open(src_filename, O_RDONLY);
+  if (src_fd < 0) {
+    return -1;
+  }
+
+  int dst_fd = open(dst_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (dst_fd < 0) {
+    close(src_fd);
+    return -1;
+  }
+
+  ssize_t bytes = copy_file_data(src_fd, dst_fd);
+
+  close(src_fd);
+  if (close(dst_fd) < 0 || bytes < 0) {
+    unlink(dst_filename);
+    return -1;
+  }
+  return 0;
+}
+
+/* Places a copy of src_filename at dst_filename through a private temp name so readers never see
+   a partial file. Entries are never linked to outputs, an output edited in place would change
+   the entry with it. */
+static int copy_atomically(const char* src_filename, const char* dst_filename,
+			   const char* temp_filename) {
+  unlink(temp_filename);
+  if (copy_file(src_filename, temp_filename) < 0) {
+    return -1;
+  }
+
+  if (rename(temp_filename, dst_filename) < 0) {
+    unlink(temp_filename);
+    return -1;
+  }
+  return 0;
+}
+
+static int compare_cache_entries(const void* lhs, const void* rhs) {
+  const struct cache_entry* a = (const struct cache_entry*)lhs;
+  const struct cache_entry* b = (const struct cache_entry*)rhs;
+
+  if (a->mtime.tv_sec != b->mtime.tv_sec) {
+    return a->mtime.tv_sec < b->mtime.tv_sec ? -1 : 1;
+  }
+  if (a->mtime.tv_nsec != b->mtime.tv_nsec) {
+    return a->mtime.tv_nsec < b->mtime.tv_nsec ? -1 : 1;
+  }
+  return 0;
+}
+
+/* Least recently used entries go first, entry mtime is refreshed on every hit */
+static void evict_cache_entries(cache_context_t* cache_context) {
+  char filename[PATH_MAX];
+  struct dirent* dirent = NULL;
+  struct cache_entry* entries = NULL;
+  size_t nb_entries = 0;
+  size_t capacity = 0;
+  int64_t total_size = 0;
+  time_t now = time(NULL);
+
+  DIR* dir = opendir(cache_context->directory);
+  if (!dir) {
+    throw_warning("Could not scan the cache directory.");
+    return;
+  }
+
+  while ((dirent = readdir(dir)) != NULL) {
+    struct stat info;
+
+    get_entry_filename(cache_context, dirent->d_name, filename, sizeof(filename));
+    if (stat(filename, &info) < 0 || !S_ISREG(info.st_mode)) {
+      continue;
+    }
+
+    // Leftovers of killed jobs and fingerprints of inputs not seen for a while
+    if (dirent->d_name[0] == '.') {
+      if ((!strncmp(dirent->d_name, CACHE_TEMP_PREFIX, strlen(CACHE_TEMP_PREFIX)) &&
+	   now - info.st_mtime > CACHE_STALE_TEMP_AGE) ||
+	  (!strncmp(dirent->d_name, CACHE_FINGERPRINT_PREFIX, strlen(CACHE_FINGERPRINT_PREFIX)) &&
+	   now - info.st_mtime > CACHE_STALE_FINGERPRINT_AGE)) {
+	unlink(filename);
+      }
+      continue;
+    }
+    if (strlen(dirent->d_name) != CACHE_KEY_SIZE - 1) {
+      continue;
+    }
+
+    if (nb_entries == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      entries = (struct cache_entry*)realloc(entries, capacity * sizeof(struct cache_entry));
+      if (!entries) {
+	throw_error("Cache entry list allocation failed.", -1);
+      }
+    }
+
+    strcpy(entries[nb_entries].name, dirent->d_name);
+    entries[nb_entries].size = info.st_size;
+    entries[nb_entries].mtime = info.st_mtim;
+    total_size += info.st_size;
+    nb_entries++;
+  }
+  closedir(dir);
+
+  if (total_size > cache_context->max_size) {
+    qsort(entries, nb_entries, sizeof(struct cache_entry), compare_cache_entries);
+    for (size_t i = 0; i < nb_entries && total_size > cache_context->max_size; i++) {
+      get_entry_filename(cache_context, entries[i].name, filename, sizeof(filename));
+      if (unlink(filename) == 0) {
+	total_size -= entries[i].size;
+      }
+    }
+  }
+
+  free(entries);
+}
+
+void cache_open(cache_context_t** cache_context, const char* directory, int64_t max_size,
+		int fingerprint) {
+  cache_context_t* context = (cache_context_t*)malloc(sizeof(cache_context_t));
+
+  if (strlen(directory) >= sizeof(context->directory)) {
+    throw_error("Cache directory path is too long.", -1);
+  }
+  if (mkdir(directory, 0755) < 0 && errno != EEXIST) {
+    throw_error("Could not create the cache directory.", -1);
+  }
+
+  strcpy(context->directory, directory);
+  context->max_size = max_size;
+  context->fingerprint = fingerprint;
+
+  *cache_context = context;
+}
+
+void cache_close(cache_context_t** cache_context) {
+  free(*cache_context);
+  *cache_context = NULL;
+}
+
+void cache_make_key(cache_context_t* cache_context, const char* input_filename, float start_ts,
+		    float end_ts, const char* settings, const char* output_filename, char* key) {
+  char buffer[64];
+  uint8_t digest[32];
+
+  struct AVSHA* sha = allocate_sha();
+  hash_input_identity(cache_context, sha, input_filename);
+
+  snprintf(buffer, sizeof(buffer), "range=%.3f-%.3f", start_ts, end_ts);
+  hash_string(sha, buffer);
+  hash_string(sha, settings);
+
+  // The same streams in another container are another file
+  const AVOutputFormat* output_format = av_guess_format(NULL, output_filename, NULL);
+  const char* extension = strrchr(output_filename, '.');
+  snprintf(buffer, sizeof(buffer), "format=%s", output_format ? output_format->name :
+	   extension ? extension : "");
+  hash_string(sha, buffer);
+
+  av_sha_final(sha, digest);
+  av_free(sha);
+
+  format_digest(digest, key);
+}
+
+int cache_fetch(cache_context_t* cache_context, const char* key, const char* output_filename) {
+  char entry_filename[PATH_MAX];
+  char temp_filename[PATH_MAX];
+
+  get_entry_filename(cache_context, key, entry_filename, sizeof(entry_filename));
+  if (access(entry_filename, R_OK) < 0) {
+    return 0;
+  }
+
+  cache_get_temp_filename(output_filename, temp_filename, sizeof(temp_filename));
+  if (copy_atomically(entry_filename, output_filename, temp_filename) < 0) {
+    // The entry may have been evicted in the meantime, treat it as a miss
+    return 0;
+  }
+
+  utimensat(AT_FDCWD, entry_filename, NULL, 0);
+  return 1;
+}
+
+void cache_publish(cache_context_t* cache_context, const char* key, const char* temp_filename,
+		   const char* output_filename) {
+  char entry_filename[PATH_MAX];
+  char entry_temp_filename[PATH_MAX];
+
+  get_entry_filename(cache_context, key, entry_filename, sizeof(entry_filename));
+  get_directory_temp_filename(cache_context->directory, key, entry_temp_filename,
+			      sizeof(entry_temp_filename));
+
+  if (copy_atomically(temp_filename, entry_filename, entry_temp_filename) < 0) {
+    throw_warning("Could not store the output in the cache.");
+  }
+
+  if (rename(temp_filename, output_filename) < 0) {
+    throw_error("Could not move the output file into place.", -1);
+  }
+
+  evict_cache_entries(cache_context);
+}
+
+void cache_get_temp_filename(const char* filename, char* buffer, size_t size) {
+  const char* name = strrchr(filename, '/');
+
+  // Keep the extension, the muxer is guessed from it
+  if (name) {
+    char directory[PATH_MAX];
+    snprintf(directory, sizeof(directory), "%.*s", (int)(name - filename), filename);
+    get_directory_temp_filename(directory, name + 1, buffer, size);
+  } else {
+    get_directory_temp_filename(".", filename, buffer, size);
+  }
+}
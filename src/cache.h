@@ -0,0 +1,29 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_KEY_SIZE 65 // hex encoded SHA-256 with the terminating zero
+
+typedef struct cache_context cache_context_t;
+
+extern void cache_open(cache_context_t** cache_context, const char* directory, int64_t max_size,
+		       int fingerprint);
+extern void cache_close(cache_context_t** cache_context);
+
+/* The container is guessed from output_filename like the muxer does. */
+extern void cache_make_key(cache_context_t* cache_context, const char* input_filename, float start_ts,
+			   float end_ts, const char* settings, const char* output_filename, char* key);
+
+/* On a hit the stored output is copied (reflinked where possible) to output_filename and 1 is
+   returned. */
+extern int cache_fetch(cache_context_t* cache_context, const char* key, const char* output_filename);
+
+/* Stores the finished temp_filename under key and atomically renames it to output_filename. */
+extern void cache_publish(cache_context_t* cache_context, const char* key, const char* temp_filename,
+			  const char* output_filename);
+
+extern void cache_get_temp_filename(const char* filename, char* buffer, size_t size);
+
+#endif
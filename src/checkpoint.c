@@ -0,0 +1,345 @@
+#include "checkpoint.h"
+#include "cache.h"
+#include "job.h"
+#include "common/error.h"
+
+#include <libavformat/avformat.h>
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CHECKPOINT_MANIFEST_SUFFIX ".ckpt"
+#define CHECKPOINT_TS_EPSILON 0.0005f
+#define CHECKPOINT_SETTINGS_SIZE 256
+
+struct checkpoint_manifest {
+  char input_filename[PATH_MAX];
+  float start_ts;
+  float end_ts;
+  float interval;
+  char settings[CHECKPOINT_SETTINGS_SIZE]; // encoder_get_settings of the finished segments
+
+  int segments;      // finished segments
+  float last_ts;     // source timestamp the finished segments reach
+  int samples_count; // audio samples written by the finished segments
+};
+
+static void get_manifest_filename(const char* checkpoint_filename, char* buffer, size_t size) {
+  snprintf(buffer, size, "%s" CHECKPOINT_MANIFEST_SUFFIX, checkpoint_filename);
+}
+
+void checkpoint_get_segment_filename(const char* checkpoint_filename, int index, char* buffer,
+				     size_t size) {
+  const char* name = strrchr(checkpoint_filename, '/');
+  const char* extension = strrchr(name ? name : checkpoint_filename, '.');
+
+  // The extension has to stay last, the muxer is guessed from it
+  if (!extension) {
+    extension = checkpoint_filename + strlen(checkpoint_filename);
+  }
+  snprintf(buffer, size, "%.*s.part%04d%s", (int)(extension - checkpoint_filename),
+	   checkpoint_filename, index, extension);
+}
+
+static int same_timestamp(float a, float b) {
+  return fabsf(a - b) < CHECKPOINT_TS_EPSILON;
+}
+
+static int read_manifest(const char* filename, struct checkpoint_manifest* manifest) {
+  char line[PATH_MAX + 32];
+  int fields = 0;
+
+  FILE* file = fopen(filename, "r");
+  if (!file) {
+    return 0;
+  }
+
+  while (fgets(line, sizeof(line), file)) {
+    line[strcspn(line, "\n")] = '\0';
+    if (!line[0]) {
+      continue;
+    }
+    if (!strncmp(line, "input=", 6)) {
+      snprintf(manifest->input_filename, sizeof(manifest->input_filename), "%s", line + 6);
+      fields++;
+    } else if (!strncmp(line, "settings=", 9)) {
+      snprintf(manifest->settings, sizeof(manifest->settings), "%s", line + 9);
+      fields++;
+    } else {
+      fields += sscanf(line, "start=%f", &manifest->start_ts);
+      fields += sscanf(line, "end=%f", &manifest->end_ts);
+      fields += sscanf(line, "interval=%f", &manifest->interval);
+      fields += sscanf(line, "segments=%d", &manifest->segments);
+      fields += sscanf(line, "last_ts=%f", &manifest->last_ts);
+      fields += sscanf(line, "samples_count=%d", &manifest->samples_count);
+    }
+  }
+
+  fclose(file);
+  return fields == 8;
+}
+
+/* Written to a temp file and renamed so a kill never leaves a torn manifest */
+static void write_manifest(const char* filename, const struct checkpoint_manifest* manifest) {
+  char temp_filename[PATH_MAX];
+
+  cache_get_temp_filename(filename, temp_filename, sizeof(temp_filename));
+
+  FILE* file = fopen(temp_filename, "w");
+  if (!file) {
+    throw_error("Could not write the checkpoint manifest.", -1);
+  }
+
+  fprintf(file, "input=%s\n", manifest->input_filename);
+  fprintf(file, "start=%.3f\n", manifest->start_ts);
+  fprintf(file, "end=%.3f\n", manifest->end_ts);
+  fprintf(file, "interval=%.3f\n", manifest->interval);
+  fprintf(file, "settings=%s\n", manifest->settings);
+  fprintf(file, "segments=%d\n", manifest->segments);
+  fprintf(file, "last_ts=%.3f\n", manifest->last_ts);
+  fprintf(file, "samples_count=%d\n", manifest->samples_count);
+
+  if (fflush(file) != 0 || fsync(fileno(file)) < 0) {
+    throw_error("Could not write the checkpoint manifest.", -1);
+  }
+  fclose(file);
+
+  if (rename(temp_filename, filename) < 0) {
+    throw_error("Could not update the checkpoint manifest.", -1);
+  }
+}
+
+/* Segments encoded with other settings would be joined into a mixed output */
+static int manifest_matches(const struct checkpoint_manifest* manifest, const char* input_filename,
+			    float start_ts, float end_ts, float interval, const char* settings) {
+  return !strcmp(manifest->input_filename, input_filename) &&
+    same_timestamp(manifest->start_ts, start_ts) && same_timestamp(manifest->end_ts, end_ts) &&
+    same_timestamp(manifest->interval, interval) && !strcmp(manifest->settings, settings);
+}
+
+/* A manifest left behind by a kill during cleanup may point at segments that are gone */
+static int segments_exist(const char* checkpoint_filename, int nb_segments) {
+  char segment_filename[PATH_MAX];
+  struct stat info;
+
+  for (int i = 0; i < nb_segments; i++) {
+    checkpoint_get_segment_filename(checkpoint_filename, i, segment_filename,
+				    sizeof(segment_filename));
+    if (stat(segment_filename, &info) < 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void open_join_output(AVFormatContext** output_context, AVFormatContext* input_context,
+			     const char* output_filename) {
+  int status = 0;
+
+  avformat_alloc_output_context2(output_context, NULL, NULL, output_filename);
+  if (!*output_context) {
+    throw_error("Joined output format context could not open.", -1);
+  }
+
+  for (unsigned int i = 0; i < input_context->nb_streams; i++) {
+    AVStream* stream = avformat_new_stream(*output_context, NULL);
+    if (!stream) {
+      throw_error("Joined output stream could not create.", -1);
+    }
+
+    status = avcodec_parameters_copy(stream->codecpar, input_context->streams[i]->codecpar);
+    if (status < 0) {
+      throw_error("Failed to copy segment codec parameters.", status);
+    }
+    stream->codecpar->codec_tag = 0;
+    stream->time_base = input_context->streams[i]->time_base;
+  }
+
+  if (!((*output_context)->oformat->flags & AVFMT_NOFILE)) {
+    status = avio_open(&(*output_context)->pb, output_filename, AVIO_FLAG_WRITE);
+    if (status < 0) {
+      throw_error(av_err2str(status), status);
+    }
+  }
+
+  status = avformat_write_header(*output_context, NULL);
+  if (status < 0) {
+    throw_error(av_err2str(status), status);
+  }
+}
+
+static void join_segments(const char** segment_filenames, int nb_segments,
+			  const char* output_filename) {
+  int status = 0;
+  AVFormatContext* output_context = NULL;
+
+  AVPacket* avpacket = av_packet_alloc();
+  if (!avpacket) {
+    throw_error("Packet allocation failed.", -1);
+  }
+
+  for (int i = 0; i < nb_segments; i++) {
+    AVFormatContext* input_context = NULL;
+
+    status = avformat_open_input(&input_context, segment_filenames[i], NULL, NULL);
+    if (status < 0) {
+      throw_error(av_err2str(status), status);
+    }
+
+    if (!output_context) {
+      open_join_output(&output_context, input_context, output_filename);
+    } else if (input_context->nb_streams != output_context->nb_streams) {
+      throw_error("Segments have different stream layouts.", -1);
+    }
+
+    // Segment timestamps are already continuous, packets are only copied over
+    while (av_read_frame(input_context, avpacket) >= 0) {
+      AVStream* input_stream = input_context->streams[avpacket->stream_index];
+      AVStream* output_stream = output_context->streams[avpacket->stream_index];
+
+      av_packet_rescale_ts(avpacket, input_stream->time_base, output_stream->time_base);
+      avpacket->pos = -1;
+
+      status = av_interleaved_write_frame(output_context, avpacket);
+      if (status < 0) {
+	throw_error("Error during writting to file.", status);
+      }
+      av_packet_unref(avpacket);
+    }
+
+    avformat_close_input(&input_context);
+  }
+
+  if (output_context) {
+    av_write_trailer(output_context);
+    if (!(output_context->oformat->flags & AVFMT_NOFILE)) {
+      avio_closep(&output_context->pb);
+    }
+    avformat_free_context(output_context);
+  }
+  av_packet_free(&avpacket);
+}
+
+void checkpoint_join_output(const char* checkpoint_filename, int nb_segments,
+			    const char* output_filename) {
+  char temp_filename[PATH_MAX];
+  char** segment_filenames = (char**)malloc(nb_segments * sizeof(char*));
+
+  if (!segment_filenames) {
+    throw_error("Segment list allocation failed.", -1);
+  }
+
+  for (int i = 0; i < nb_segments; i++) {
+    segment_filenames[i] = (char*)malloc(PATH_MAX);
+    if (!segment_filenames[i]) {
+      throw_error("Segment list allocation failed.", -1);
+    }
+    checkpoint_get_segment_filename(checkpoint_filename, i, segment_filenames[i], PATH_MAX);
+  }
+
+  cache_get_temp_filename(output_filename, temp_filename, sizeof(temp_filename));
+  join_segments((const char**)segment_filenames, nb_segments, temp_filename);
+
+  if (rename(temp_filename, output_filename) < 0) {
+    throw_error("Could not move the joined output into place.", -1);
+  }
+
+  for (int i = 0; i < nb_segments; i++) {
+    free(segment_filenames[i]);
+  }
+  free(segment_filenames);
+}
+
+void checkpoint_remove_segments(const char* checkpoint_filename, int nb_segments) {
+  char segment_filename[PATH_MAX];
+
+  for (int i = 0; i < nb_segments; i++) {
+    checkpoint_get_segment_filename(checkpoint_filename, i, segment_filename,
+				    sizeof(segment_filename));
+    unlink(segment_filename);
+  }
+}
+
+void checkpoint_transcode(const char* input_filename, float start_ts, float end_ts, float interval,
+			  const struct encoder_options* encoder_options,
+			  const char* checkpoint_filename, const char* output_filename) {
+  char manifest_filename[PATH_MAX];
+  char segment_filename[PATH_MAX];
+  char temp_filename[PATH_MAX];
+  char settings[CHECKPOINT_SETTINGS_SIZE];
+  struct checkpoint_manifest manifest;
+  struct encoder_options default_options;
+
+  if (interval <= 0) {
+    throw_error("Checkpoint interval must be positive.", -1);
+  }
+  if (start_ts > end_ts) {
+    throw_error("Start timestamp < end timestamp.", -1);
+  }
+
+  if (!encoder_options) {
+    encoder_init_options(&default_options);
+    encoder_options = &default_options;
+  }
+  encoder_get_settings(encoder_options, settings, sizeof(settings));
+
+  get_manifest_filename(checkpoint_filename, manifest_filename, sizeof(manifest_filename));
+
+  if (read_manifest(manifest_filename, &manifest) &&
+      manifest_matches(&manifest, input_filename, start_ts, end_ts, interval, settings) &&
+      segments_exist(checkpoint_filename, manifest.segments)) {
+    throw_warning("Resuming from the last checkpoint.");
+  } else {
+    snprintf(manifest.input_filename, sizeof(manifest.input_filename), "%s", input_filename);
+    manifest.start_ts = start_ts;
+    manifest.end_ts = end_ts;
+    manifest.interval = interval;
+    snprintf(manifest.settings, sizeof(manifest.settings), "%s", settings);
+    manifest.segments = 0;
+    manifest.last_ts = start_ts;
+    manifest.samples_count = 0;
+  }
+
+  int nb_segments = (int)ceilf((end_ts - start_ts) / interval);
+  if (nb_segments < 1) {
+    nb_segments = 1;
+  }
+
+  while (manifest.segments < nb_segments) {
+    struct job_segment segment;
+    int last_segment = manifest.segments == nb_segments - 1;
+    float segment_end_ts = last_segment ? end_ts : start_ts + (manifest.segments + 1) * interval;
+
+    job_init_segment(&segment, input_filename, manifest.last_ts, segment_end_ts);
+    segment.origin_ts = start_ts;
+    segment.end_exclusive = !last_segment;
+    segment.samples_count = manifest.samples_count;
+    segment.encoder_options = encoder_options;
+
+    // A segment only becomes visible under its final name once it is closed
+    checkpoint_get_segment_filename(checkpoint_filename, manifest.segments, segment_filename,
+				    sizeof(segment_filename));
+    cache_get_temp_filename(segment_filename, temp_filename, sizeof(temp_filename));
+
+    job_transcode(&segment, temp_filename);
+
+    if (rename(temp_filename, segment_filename) < 0) {
+      throw_error("Could not move the finished segment into place.", -1);
+    }
+
+    manifest.segments++;
+    manifest.last_ts = segment_end_ts;
+    manifest.samples_count = segment.samples_count;
+    write_manifest(manifest_filename, &manifest);
+  }
+
+  // The manifest goes first, a kill before the segments are removed then only leaves files behind
+  checkpoint_join_output(checkpoint_filename, nb_segments, output_filename);
+  unlink(manifest_filename);
+  checkpoint_remove_segments(checkpoint_filename, nb_segments);
+}
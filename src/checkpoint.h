@@ -0,0 +1,27 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include "encoder.h"
+
+#include <stddef.h>
+
+/*
+ * Encodes the range as closed segments of interval seconds next to checkpoint_filename and
+ * records the progress in a manifest after each one. A restarted job with the same arguments
+ * and encoder settings continues after the last finished segment. The segments are joined into
+ * output_filename without re-encoding once the whole range is done.
+ */
+extern void checkpoint_transcode(const char* input_filename, float start_ts, float end_ts,
+				 float interval, const struct encoder_options* encoder_options,
+				 const char* checkpoint_filename, const char* output_filename);
+
+/* Names the index-th segment file of an output, keeping its extension last. */
+extern void checkpoint_get_segment_filename(const char* filename, int index, char* buffer,
+					    size_t size);
+
+/* Remuxes the closed segment files of checkpoint_filename, in order, into output_filename. */
+extern void checkpoint_join_output(const char* checkpoint_filename, int nb_segments,
+				   const char* output_filename);
+extern void checkpoint_remove_segments(const char* checkpoint_filename, int nb_segments);
+
+#endif
@@ -0,0 +1,22 @@
+#include "cpu.h"
+
+#include <pthread.h>
+
+static enum cpu_level detected_level = CPU_LEVEL_C;
+static pthread_once_t detect_once = PTHREAD_ONCE_INIT;
+
+static void detect_level() {
+#ifdef CPU_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    detected_level = CPU_LEVEL_AVX2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    detected_level = CPU_LEVEL_SSE2;
+  }
+#endif
+}
+
+enum cpu_level cpu_get_level() {
+  pthread_once(&detect_once, detect_level);
+  return detected_level;
+}
@@ -0,0 +1,17 @@
+#ifndef _CPU_H_
+#define _CPU_H_
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_X86 1
+#endif
+
+enum cpu_level {
+  CPU_LEVEL_C,
+  CPU_LEVEL_SSE2,
+  CPU_LEVEL_AVX2,
+};
+
+/* Best SIMD level the build has kernels for and the running CPU supports, detected once. */
+extern enum cpu_level cpu_get_level();
+
+#endif
@@ -4,11 +4,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+static __thread jmp_buf* error_catch_point = NULL;
+
 void throw_error(const char* message, int code) {
   fprintf(stderr, "%s: %s\n", get_basename(), message);
+
+  // Cleared first, the same failure must not jump back into the code that caught it
+  jmp_buf* catch_point = error_catch_point;
+  if (catch_point) {
+    error_catch_point = NULL;
+    longjmp(*catch_point, code ? code : -1);
+  }
   exit(code);
 }
 
 void throw_warning(const char* message) {
   fprintf(stdout, "%s: %s\n", get_basename(), message);
 }
+
+void set_error_catch(jmp_buf* catch_point) {
+  error_catch_point = catch_point;
+}
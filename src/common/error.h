@@ -1,7 +1,14 @@
 #ifndef _ERROR_H_
 #define _ERROR_H_
 
+#include <setjmp.h>
+
 extern void throw_error(const char* message, int code);
 extern void throw_warning(const char* message);
 
+/* While set, the next throw_error on this thread prints its message and jumps back to catch_point
+   (setjmp returns the code, -1 for 0) instead of exiting. Whatever the failed code held is left
+   behind, only for work whose failure must not end the process. */
+extern void set_error_catch(jmp_buf* catch_point);
+
 #endif
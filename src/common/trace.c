@@ -0,0 +1,154 @@
+#include "trace.h"
+#include "error.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define TRACE_BLOCK_EVENTS 4096
+
+struct trace_event {
+  const char* name; // string literals only, the pointer is kept until exit
+  int64_t time;     // nanoseconds since trace_open
+  int64_t pts;
+  char phase;
+};
+
+/* Blocks are only appended, never moved, the writer can dump them while a thread still records */
+struct trace_block {
+  struct trace_event events[TRACE_BLOCK_EVENTS];
+  int count;
+  struct trace_block* next;
+};
+
+struct trace_thread {
+  int tid;
+  struct trace_block* first;
+  struct trace_block* last;
+  struct trace_thread* next;
+};
+
+static const char* trace_filename = NULL;
+static int64_t trace_origin = 0;
+static struct trace_thread* trace_threads = NULL;
+static int trace_next_tid = 0;
+static __thread struct trace_thread* current_thread = NULL;
+
+static int64_t get_monotonic_time() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static struct trace_block* allocate_block() {
+  struct trace_block* block = (struct trace_block*)malloc(sizeof(struct trace_block));
+  if (!block) {
+    throw_error("Trace allocation failed.", -1);
+  }
+  block->count = 0;
+  block->next = NULL;
+  return block;
+}
+
+static struct trace_thread* get_thread() {
+  if (current_thread) {
+    return current_thread;
+  }
+
+  struct trace_thread* thread = (struct trace_thread*)malloc(sizeof(struct trace_thread));
+  if (!thread) {
+    throw_error("Trace allocation failed.", -1);
+  }
+  thread->tid = __sync_add_and_fetch(&trace_next_tid, 1);
+  thread->first = allocate_block();
+  thread->last = thread->first;
+
+  // Lock-free push, only the writer at exit walks the list
+  do {
+    thread->next = trace_threads;
+  } while (!__sync_bool_compare_and_swap(&trace_threads, thread->next, thread));
+
+  current_thread = thread;
+  return thread;
+}
+
+static void record_event(const char* name, int64_t pts, char phase) {
+  struct trace_thread* thread = get_thread();
+  struct trace_block* block = thread->last;
+
+  if (block->count == TRACE_BLOCK_EVENTS) {
+    struct trace_block* next = allocate_block();
+    __sync_synchronize();
+    block->next = next;
+    thread->last = next;
+    block = next;
+  }
+
+  struct trace_event* event = &block->events[block->count];
+  event->name = name;
+  event->time = get_monotonic_time() - trace_origin;
+  event->pts = pts;
+  event->phase = phase;
+
+  // The event is complete before the writer can count it
+  __sync_synchronize();
+  block->count++;
+}
+
+static void write_event(FILE* file, const struct trace_event* event, int tid, int* first) {
+  fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d",
+	  *first ? "" : ",", event->name, event->phase, event->time / 1e3, tid);
+  if (event->pts != TRACE_NO_PTS) {
+    fprintf(file, ",\"args\":{\"pts\":%" PRId64 "}", event->pts);
+  }
+  fputc('}', file);
+  *first = 0;
+}
+
+static void write_trace() {
+  int first = 1;
+
+  FILE* file = fopen(trace_filename, "w");
+  if (!file) {
+    throw_warning("Could not write the trace file.");
+    return;
+  }
+
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+  for (struct trace_thread* thread = trace_threads; thread; thread = thread->next) {
+    for (struct trace_block* block = thread->first; block; block = block->next) {
+      int count = block->count;
+      __sync_synchronize();
+      for (int i = 0; i < count; i++) {
+	write_event(file, &block->events[i], thread->tid, &first);
+      }
+    }
+  }
+  fputs("\n]}\n", file);
+
+  if (fclose(file) != 0) {
+    throw_warning("Could not write the trace file.");
+  }
+}
+
+void trace_open(const char* filename) {
+  if (trace_filename) {
+    return;
+  }
+  trace_origin = get_monotonic_time();
+  trace_filename = filename;
+  atexit(write_trace);
+}
+
+void trace_begin(const char* name, int64_t pts) {
+  if (trace_filename) {
+    record_event(name, pts, 'B');
+  }
+}
+
+void trace_end(const char* name, int64_t pts) {
+  if (trace_filename) {
+    record_event(name, pts, 'E');
+  }
+}
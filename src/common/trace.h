@@ -0,0 +1,20 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#define TRACE_NO_PTS INT64_MIN // same value as AV_NOPTS_VALUE
+
+/*
+ * Records spans in the Chrome trace-event format (chrome://tracing, Perfetto), written to filename
+ * when the process exits. Every thread fills its own buffer, so recording takes no lock, and
+ * nothing is recorded before trace_open. Call it once, before any other thread starts.
+ */
+extern void trace_open(const char* filename);
+
+/* Spans nest per thread, pts is the timestamp of the packet or frame in its own time base and is
+   left out when TRACE_NO_PTS. The end of a span may carry a pts its begin could not know yet. */
+extern void trace_begin(const char* name, int64_t pts);
+extern void trace_end(const char* name, int64_t pts);
+
+#endif
@@ -1,14 +1,20 @@
 #include "decoder.h"
+#include "streamprofile.h"
 #include "common/error.h"
+#include "common/trace.h"
 
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#include <libavutil/time.h>
 
 #include <stdio.h>
+#include <string.h>
 
 struct timestamp {
   int64_t start;
   int64_t end;
+  int64_t origin;
+  int finished;
 };
 
 typedef struct _decoder_context {
@@ -37,10 +43,22 @@ typedef struct _decoder_context {
       struct timestamp audio_timestamp;
     };
   } media_timestamp;
+
+  int end_exclusive;
+  int audio_passthrough; // audio packets are handed out undecoded
+
+  struct stream_profile profile;
+  int profile_loaded;
+  int64_t open_time;        // av_gettime_relative() when opening started
+  int64_t first_frame_time; // from open_time, -1 until a frame inside the range came out
 } decoder_context_t;
 
+static struct decoder_options decoder_options = { 0, NULL };
+
 #define DECODER_MEDIA_CONTEXT_TYPE_VIDEO ((int)AVMEDIA_TYPE_VIDEO)
 #define DECODER_MEDIA_CONTEXT_TYPE_AUDIO ((int)AVMEDIA_TYPE_AUDIO)
+#define DECODER_TIME_BASE ((AVRational){1, DECODER_TIME_BASE_DEN})
+#define DECODER_AUDIO_PREROLL 0.2f // seconds, longer than any audio frame
 
 void allocate_decoder_context(decoder_context_t** decoder_context) {
   decoder_context_t* context = (decoder_context_t*)malloc(sizeof(decoder_context_t));
@@ -49,26 +67,131 @@ void allocate_decoder_context(decoder_context_t** decoder_context) {
   if (!context->format_context) {
     throw_error("Decoder format context could not allocate.", -1);
   }
+  context->media_context.video_codec_context = NULL;
+  context->media_context.audio_codec_context = NULL;
+  context->end_exclusive = 0;
+  context->audio_passthrough = 0;
+  context->profile_loaded = 0;
+  context->open_time = av_gettime_relative();
+  context->first_frame_time = -1;
   
   *decoder_context = context;
 }
 
 void open_decoder_format_context(decoder_context_t* decoder_context, const char* filename) {
-  int status = avformat_open_input(&decoder_context->format_context, filename, NULL, NULL);
+  AVDictionary* options = NULL;
+  AVInputFormat* input_format = NULL;
+
+  if (decoder_options.probe_size > 0) {
+    av_dict_set_int(&options, "probesize", decoder_options.probe_size, 0);
+  }
+
+  // A known demuxer skips the format probe, which reads up to probesize bytes
+  if (decoder_options.profile_dir) {
+    decoder_context->profile_loaded = stream_profile_load(decoder_options.profile_dir, filename,
+							  &decoder_context->profile);
+  }
+  if (decoder_context->profile_loaded) {
+    input_format = av_find_input_format(decoder_context->profile.format);
+  }
+
+  int status = avformat_open_input(&decoder_context->format_context, filename, input_format,
+				   &options);
+  av_dict_free(&options);
   if (status < 0) {
   	throw_error(/*"Could not open source file"*/av_err2str(status), status);
   }
 }
 
+int select_decoder_stream(decoder_context_t* decoder_context, int media_type) {
+  AVFormatContext* format_context = decoder_context->format_context;
+
+  if (decoder_context->profile_loaded) {
+    int stream = decoder_context->profile.streams[media_type].index;
+    if (stream >= 0 && stream < (int)format_context->nb_streams &&
+	format_context->streams[stream]->codecpar->codec_type == (enum AVMediaType)media_type) {
+      return stream;
+    }
+  }
+  return av_find_best_stream(format_context, media_type, -1, -1, NULL, 0);
+}
+
+/* Fills in what the demuxer left unknown without probing, from an earlier probe of the file */
+void apply_decoder_profile(decoder_context_t* decoder_context, int media_type) {
+  int stream = decoder_context->media_stream.stream_id_table[media_type];
+  AVStream* avstream = decoder_context->format_context->streams[stream];
+  AVCodecParameters* codecpar = avstream->codecpar;
+  const struct stream_profile_stream* profile = &decoder_context->profile.streams[media_type];
+
+  if (!decoder_context->profile_loaded || profile->codec_id != (int)codecpar->codec_id) {
+    return;
+  }
+
+  if (codecpar->format < 0) {
+    codecpar->format = profile->format;
+  }
+  if (!codecpar->width && !codecpar->height) {
+    codecpar->width = profile->width;
+    codecpar->height = profile->height;
+  }
+  if (!codecpar->sample_rate) {
+    codecpar->sample_rate = profile->sample_rate;
+  }
+  if (!codecpar->channels) {
+    codecpar->channels = profile->channels;
+  }
+  if (!codecpar->channel_layout) {
+    codecpar->channel_layout = profile->channel_layout;
+  }
+  if ((avstream->time_base.num <= 0 || avstream->time_base.den <= 0) &&
+      profile->time_base_num > 0 && profile->time_base_den > 0) {
+    avstream->time_base = (AVRational){ profile->time_base_num, profile->time_base_den };
+  }
+}
+
+void save_decoder_profile(decoder_context_t* decoder_context, const char* filename) {
+  struct stream_profile profile;
+  AVFormatContext* format_context = decoder_context->format_context;
+
+  if (!decoder_options.profile_dir || decoder_context->profile_loaded) {
+    return;
+  }
+
+  memset(&profile, 0, sizeof(profile));
+  snprintf(profile.format, sizeof(profile.format), "%.*s",
+	   (int)strcspn(format_context->iformat->name, ","), format_context->iformat->name);
+
+  for (int media_type = 0; media_type < 2; media_type++) {
+    int stream = decoder_context->media_stream.stream_id_table[media_type];
+    AVStream* avstream = format_context->streams[stream];
+    AVCodecParameters* codecpar = avstream->codecpar;
+
+    profile.streams[media_type] = (struct stream_profile_stream){
+      stream, codecpar->codec_id, codecpar->format, codecpar->width, codecpar->height,
+      codecpar->sample_rate, codecpar->channels, codecpar->channel_layout,
+      avstream->time_base.num, avstream->time_base.den,
+    };
+  }
+
+  stream_profile_save(decoder_options.profile_dir, filename, &profile);
+}
+
 void open_decoder_codec_context(decoder_context_t* decoder_context, int media_type) {
   int status = 0;
   AVCodec* codec = NULL;
   AVCodecContext* codec_context = NULL;
   
-  int stream = av_find_best_stream(decoder_context->format_context, media_type, -1, -1, &codec, 0);
+  int stream = select_decoder_stream(decoder_context, media_type);
   if (stream < 0) {
     throw_error("Decoder's video/audio codec could found for this media file.", stream);
   }
+  decoder_context->media_stream.stream_id_table[media_type] = stream;
+  apply_decoder_profile(decoder_context, media_type);
+
+  codec = avcodec_find_decoder(decoder_context->format_context->streams[stream]->codecpar->codec_id);
+  if (!codec) {
+    throw_error("Decoder's video/audio codec could found for this media file.", -1);
+  }
   
   codec_context = avcodec_alloc_context3(codec);
   if (!codec_context) {
@@ -88,7 +211,15 @@ void open_decoder_codec_context(decoder_context_t* decoder_context, int media_ty
   }
   
   decoder_context->media_context.codec_context_table[media_type] = codec_context;
+}
+
+void find_decoder_stream(decoder_context_t* decoder_context, int media_type) {
+  int stream = select_decoder_stream(decoder_context, media_type);
+  if (stream < 0) {
+    throw_error("Decoder's video/audio stream could not found for this media file.", stream);
+  }
   decoder_context->media_stream.stream_id_table[media_type] = stream;
+  apply_decoder_profile(decoder_context, media_type);
 }
 
 AVCodecContext* find_decoder_codec_context_by_stream_index(decoder_context_t* decoder_context,
@@ -122,7 +253,8 @@ enum frame_type find_decoder_frame_type_by_stream_index(decoder_context_t* decod
 void seek_decoder_timestamp(decoder_context_t* decoder_context, float start_ts, float end_ts,
 			    int media_type) {
   int status = 0;
-  AVStream* avstream = decoder_context->format_context->streams[media_type];
+  int stream = decoder_context->media_stream.stream_id_table[media_type];
+  AVStream* avstream = decoder_context->format_context->streams[stream];
   
   uint64_t start_timestamp = av_rescale_q((int64_t)(start_ts * AV_TIME_BASE),
 					  (AVRational){1, AV_TIME_BASE}, avstream->time_base);
@@ -137,6 +269,8 @@ void seek_decoder_timestamp(decoder_context_t* decoder_context, float start_ts,
 
   decoder_context->media_timestamp.timestamp_table[media_type].start = start_timestamp;
   decoder_context->media_timestamp.timestamp_table[media_type].end = end_timestamp;
+  decoder_context->media_timestamp.timestamp_table[media_type].origin = start_timestamp;
+  decoder_context->media_timestamp.timestamp_table[media_type].finished = 0;
 }
 
 void set_decoder_timestamp(decoder_context_t* decoder_context, float start_ts, float end_ts) {
@@ -149,16 +283,55 @@ void set_decoder_timestamp(decoder_context_t* decoder_context, float start_ts, f
 }
 
 int check_frame_timestamp(decoder_context_t* decoder_context, AVFrame* frame, int media_type) {
-  int64_t start_timestamp = decoder_context->media_timestamp.timestamp_table[media_type].start;
-  int64_t end_timestamp = decoder_context->media_timestamp.timestamp_table[media_type].end;
+  struct timestamp* timestamp = &decoder_context->media_timestamp.timestamp_table[media_type];
+
+  if (frame->pts > timestamp->end ||
+      (frame->pts == timestamp->end && decoder_context->end_exclusive)) {
+    timestamp->finished = 1;
+    return 0;
+  }
 
-  if (frame->pts >= start_timestamp && frame->pts <= end_timestamp) {
-    frame->pts -= start_timestamp;
+  if (frame->pts >= timestamp->start) {
+    int stream = decoder_context->media_stream.stream_id_table[media_type];
+    AVRational time_base = decoder_context->format_context->streams[stream]->time_base;
+    frame->pts = av_rescale_q(frame->pts - timestamp->origin, time_base, DECODER_TIME_BASE);
     return 1;
   }
   return 0;
 }
 
+/* A packet is kept whole when its middle falls inside the range, the cut lands on the nearest
+   frame boundary. Like frames, a middle exactly at the end belongs to the next segment only when
+   the end is exclusive */
+int check_packet_timestamp(decoder_context_t* decoder_context, AVPacket* packet, int media_type) {
+  struct timestamp* timestamp = &decoder_context->media_timestamp.timestamp_table[media_type];
+  if (packet->pts == AV_NOPTS_VALUE) {
+    return 0;
+  }
+
+  int64_t middle = packet->pts + packet->duration / 2;
+  if (middle > timestamp->end || (middle == timestamp->end && decoder_context->end_exclusive)) {
+    timestamp->finished = 1;
+    return 0;
+  }
+
+  if (middle >= timestamp->start) {
+    int stream = decoder_context->media_stream.stream_id_table[media_type];
+    AVRational time_base = decoder_context->format_context->streams[stream]->time_base;
+    packet->pts = av_rescale_q(packet->pts - timestamp->origin, time_base, DECODER_TIME_BASE);
+    packet->dts = packet->pts;
+    packet->duration = av_rescale_q(packet->duration, time_base, DECODER_TIME_BASE);
+    packet->pos = -1;
+    return 1;
+  }
+  return 0;
+}
+
+int check_decoder_finished(decoder_context_t* decoder_context) {
+  return decoder_context->media_timestamp.video_timestamp.finished &&
+    decoder_context->media_timestamp.audio_timestamp.finished;
+}
+
 void decoder_open(decoder_context_t** decoder_context, const char* filename, float start_ts,
 		  float end_ts) {
   allocate_decoder_context(decoder_context);
@@ -166,6 +339,7 @@ void decoder_open(decoder_context_t** decoder_context, const char* filename, flo
 
   open_decoder_codec_context(*decoder_context, DECODER_MEDIA_CONTEXT_TYPE_VIDEO);
   open_decoder_codec_context(*decoder_context, DECODER_MEDIA_CONTEXT_TYPE_AUDIO);
+  save_decoder_profile(*decoder_context, filename);
 
   set_decoder_timestamp(*decoder_context, start_ts, end_ts);
 }
@@ -181,29 +355,198 @@ void decoder_close(decoder_context_t** decoder_context) {
   context = NULL;
 }
 
+void decoder_set_origin(decoder_context_t* decoder_context, float origin_ts) {
+  for (int media_type = 0; media_type < 2; media_type++) {
+    int stream = decoder_context->media_stream.stream_id_table[media_type];
+    AVStream* avstream = decoder_context->format_context->streams[stream];
+
+    decoder_context->media_timestamp.timestamp_table[media_type].origin =
+      av_rescale_q((int64_t)((double)origin_ts * AV_TIME_BASE), (AVRational){1, AV_TIME_BASE},
+		   avstream->time_base);
+  }
+}
+
+void decoder_set_audio_start(decoder_context_t* decoder_context, float start_ts) {
+  struct timestamp* timestamp = &decoder_context->media_timestamp.audio_timestamp;
+  int64_t end = timestamp->end;
+  int64_t origin = timestamp->origin;
+
+  // The frame the start falls into begins earlier, it has to come out whole to be cut
+  seek_decoder_timestamp(decoder_context, start_ts - DECODER_AUDIO_PREROLL,
+			 start_ts - DECODER_AUDIO_PREROLL, DECODER_MEDIA_CONTEXT_TYPE_AUDIO);
+  timestamp->end = end;
+  timestamp->origin = origin;
+}
+
+void decoder_set_end_exclusive(decoder_context_t* decoder_context, int end_exclusive) {
+  decoder_context->end_exclusive = end_exclusive;
+}
+
+void decoder_set_audio_passthrough(decoder_context_t* decoder_context, int audio_passthrough) {
+  decoder_context->audio_passthrough = audio_passthrough;
+}
+
+void* decoder_get_codec_parameters(decoder_context_t* decoder_context, int media_type) {
+  int stream = decoder_context->media_stream.stream_id_table[media_type];
+  return decoder_context->format_context->streams[stream]->codecpar;
+}
+
+float decoder_find_keyframe(decoder_context_t* decoder_context, float ts) {
+  int stream = decoder_context->media_stream.video_stream_id;
+  AVStream* avstream = decoder_context->format_context->streams[stream];
+
+  int64_t timestamp = av_rescale_q((int64_t)((double)ts * AV_TIME_BASE),
+				   (AVRational){1, AV_TIME_BASE}, avstream->time_base);
+
+  // Without flags the search returns the first keyframe at or after the timestamp
+  int index = av_index_search_timestamp(avstream, timestamp, 0);
+  if (index < 0) {
+    return ts;
+  }
+
+  return (float)(avstream->index_entries[index].timestamp * av_q2d(avstream->time_base));
+}
+
+void decoder_probe(decoder_context_t** decoder_context, const char* filename) {
+  allocate_decoder_context(decoder_context);
+  open_decoder_format_context(*decoder_context, filename);
+
+  find_decoder_stream(*decoder_context, DECODER_MEDIA_CONTEXT_TYPE_VIDEO);
+  find_decoder_stream(*decoder_context, DECODER_MEDIA_CONTEXT_TYPE_AUDIO);
+  save_decoder_profile(*decoder_context, filename);
+}
+
+void decoder_init_options(struct decoder_options* options) {
+  options->probe_size = 0;
+  options->profile_dir = NULL;
+}
+
+void decoder_set_options(const struct decoder_options* options) {
+  decoder_options = *options;
+}
+
+int64_t decoder_get_first_frame_time(decoder_context_t* decoder_context) {
+  return decoder_context->first_frame_time;
+}
+
+void decoder_get_stream_info(decoder_context_t* decoder_context, int media_type,
+			     struct decoder_stream_info* info) {
+  int stream = decoder_context->media_stream.stream_id_table[media_type];
+  AVStream* avstream = decoder_context->format_context->streams[stream];
+  AVCodecParameters* codecpar = avstream->codecpar;
+
+  info->codec_name = avcodec_get_name(codecpar->codec_id);
+  info->width = codecpar->width;
+  info->height = codecpar->height;
+  // Without a duration the demuxer leaves the average unset, the base rate is still there
+  AVRational frame_rate = avstream->avg_frame_rate.num > 0 && avstream->avg_frame_rate.den > 0 ?
+    avstream->avg_frame_rate : avstream->r_frame_rate;
+  info->frame_rate = frame_rate.num > 0 && frame_rate.den > 0 ? (float)av_q2d(frame_rate) : 0;
+  info->sample_rate = codecpar->sample_rate;
+  info->channels = codecpar->channels;
+  info->bit_rate = codecpar->bit_rate;
+}
+
+float decoder_get_duration(decoder_context_t* decoder_context) {
+  int64_t duration = decoder_context->format_context->duration;
+  return duration == AV_NOPTS_VALUE ? -1 : (float)duration / AV_TIME_BASE;
+}
+
+int64_t decoder_get_bit_rate(decoder_context_t* decoder_context) {
+  AVFormatContext* format_context = decoder_context->format_context;
+  if (format_context->bit_rate > 0) {
+    return format_context->bit_rate;
+  }
+
+  // Only stream info probing fills it in, which decodes, the file size tells the same
+  int64_t size = format_context->pb ? avio_size(format_context->pb) : -1;
+  if (size <= 0 || format_context->duration <= 0 || format_context->duration == AV_NOPTS_VALUE) {
+    return 0;
+  }
+  return av_rescale(size, 8 * AV_TIME_BASE, format_context->duration);
+}
+
+int64_t decoder_get_range_size(decoder_context_t* decoder_context, float start_ts, float end_ts) {
+  int stream = decoder_context->media_stream.video_stream_id;
+  AVStream* avstream = decoder_context->format_context->streams[stream];
+
+  int64_t start_timestamp = av_rescale_q((int64_t)((double)start_ts * AV_TIME_BASE),
+					 (AVRational){1, AV_TIME_BASE}, avstream->time_base);
+  int64_t end_timestamp = av_rescale_q((int64_t)((double)end_ts * AV_TIME_BASE),
+				       (AVRational){1, AV_TIME_BASE}, avstream->time_base);
+
+  // Byte positions of the index entries around the range bound the data read for it
+  int start_index = av_index_search_timestamp(avstream, start_timestamp, AVSEEK_FLAG_BACKWARD);
+  int end_index = av_index_search_timestamp(avstream, end_timestamp, 0);
+  if (start_index < 0 || end_index < 0) {
+    return -1;
+  }
+
+  int64_t size = avstream->index_entries[end_index].pos - avstream->index_entries[start_index].pos;
+  return size > 0 ? size : -1;
+}
+
+frame_t* mark_first_frame(decoder_context_t* decoder_context, frame_t* frame) {
+  if (decoder_context->first_frame_time < 0 && frame_get_item(frame)->stream_id >= 0) {
+    decoder_context->first_frame_time = av_gettime_relative() - decoder_context->open_time;
+  }
+  return frame;
+}
+
+frame_t* pass_decoder_packet(decoder_context_t* decoder_context, AVPacket* avpacket,
+			     int media_type) {
+  frame_t* frame = frame_alloc(FRAME_PACKET_TYPE);
+  if (!frame) {
+    throw_error("Packet allocation failed.", -1);
+  }
+
+  struct frame_item* item = frame_get_item(frame);
+  av_packet_move_ref(item->buffer, avpacket);
+  av_packet_free(&avpacket);
+
+  item->stream_id = check_packet_timestamp(decoder_context, item->buffer, media_type) ?
+    media_type : -1;
+  return mark_first_frame(decoder_context, frame);
+}
+
 frame_t* decoder_next_frame(decoder_context_t* decoder_context) {
   int status = 0;
+
+  if (check_decoder_finished(decoder_context)) {
+    return NULL; // Both streams went past the end of the range
+  }
+
   AVPacket* next_avpacket = av_packet_alloc();
-  
   if (!next_avpacket) {
     throw_error("Packet allocation failed.", -1);
   }
 
+  trace_begin("read", TRACE_NO_PTS);
   status = av_read_frame(decoder_context->format_context, next_avpacket);
+  trace_end("read", status < 0 ? TRACE_NO_PTS : next_avpacket->pts);
   if (status < 0) {
+    av_packet_free(&next_avpacket);
     return NULL; // It's mean error or end of file
   }
 
+  int stream_index = next_avpacket->stream_index;
   AVCodecContext* codec_context = find_decoder_codec_context_by_stream_index(decoder_context,
-									     next_avpacket->stream_index);
+									     stream_index);
   enum frame_type frame_type = find_decoder_frame_type_by_stream_index(decoder_context,
-								       next_avpacket->stream_index);
+								       stream_index);
+
+  if (frame_type == FRAME_AUDIO_TYPE && decoder_context->audio_passthrough) {
+    return pass_decoder_packet(decoder_context, next_avpacket, frame_type);
+  }
 
   if (frame_type == 1) {
     codec_context->pkt_timebase = (AVRational){1, codec_context->sample_rate};
   }
   
+  trace_begin("decode_send", next_avpacket->pts);
   status = avcodec_send_packet(codec_context, next_avpacket);
+  trace_end("decode_send", TRACE_NO_PTS);
+  av_packet_free(&next_avpacket);
   if (status < 0) {
     throw_error("Error sunbmitting the packet to the decoder.", status);
   }
@@ -213,10 +556,16 @@ frame_t* decoder_next_frame(decoder_context_t* decoder_context) {
 
   while (status >= 0) {
     struct frame_item* item = frame_get_item(frame_end);
-    item->stream_id = next_avpacket->stream_index;
+    item->stream_id = frame_type;
     
+    trace_begin("decode_receive", TRACE_NO_PTS);
     status = avcodec_receive_frame(codec_context, item->buffer);
+    trace_end("decode_receive", status < 0 ? TRACE_NO_PTS : ((AVFrame*)item->buffer)->pts);
     if (status == AVERROR(EAGAIN) || status == AVERROR_EOF) {
+      if (frame_end == frame_start) {
+	item->stream_id = -1; // The packet produced no frame yet, keep an empty item
+	break;
+      }
       frame_free(&frame_end);
       break;
     } else if (status < 0) {
@@ -232,5 +581,5 @@ frame_t* decoder_next_frame(decoder_context_t* decoder_context) {
     frame_attach_to(frame_start, frame_end);
   }
   
-  return frame_start;
+  return mark_first_frame(decoder_context, frame_start);
 }
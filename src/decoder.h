@@ -4,13 +4,63 @@
 #include "frame.h"
 
 #include <stddef.h>
+#include <stdint.h>
+
+#define DECODER_TIME_BASE_DEN 1000 // decoded frames carry pts in milliseconds
 
 typedef struct _decoder_context decoder_context_t;
 
+struct decoder_options {
+  int64_t probe_size;      // bytes read to detect the format, 0 for the libavformat default
+  const char* profile_dir; // stream profiles of the inputs are cached here when not NULL
+};
+
+struct decoder_stream_info {
+  const char* codec_name;
+  int width;
+  int height;
+  float frame_rate; // 0 when the container does not tell
+  int sample_rate;
+  int channels;
+  int64_t bit_rate; // 0 when the container does not tell
+};
+
+extern void decoder_init_options(struct decoder_options* options);
+/* Applies to every decoder opened afterwards, set once before any job starts. */
+extern void decoder_set_options(const struct decoder_options* options);
+
 extern void decoder_open(decoder_context_t** decoder_context, const char* filename, float start_ts,
 			 float end_ts);
 extern void decoder_close(decoder_context_t** decoder_context);
 
+/* Decoded timestamps are made relative to origin_ts instead of the start of the range, an origin
+   before the start shifts the frames later in the output. */
+extern void decoder_set_origin(decoder_context_t* decoder_context, float origin_ts);
+extern void decoder_set_end_exclusive(decoder_context_t* decoder_context, int end_exclusive);
+/* Decoded audio starts a little before start_ts instead of the start of the range, for a
+   resampler window to cut it exactly there. */
+extern void decoder_set_audio_start(decoder_context_t* decoder_context, float start_ts);
+/* Audio then comes out as FRAME_PACKET_TYPE items with millisecond timestamps, a packet is kept
+   when most of it lies inside the range. */
+extern void decoder_set_audio_passthrough(decoder_context_t* decoder_context, int audio_passthrough);
+/* AVCodecParameters of the chosen stream, owned by the decoder. */
+extern void* decoder_get_codec_parameters(decoder_context_t* decoder_context, int media_type);
+
+/* Looks up the first video keyframe at or after ts in the container index, ts if there is none. */
+extern float decoder_find_keyframe(decoder_context_t* decoder_context, float ts);
+
+/* Opens the container and picks its streams without opening any decoder. */
+extern void decoder_probe(decoder_context_t** decoder_context, const char* filename);
+extern void decoder_get_stream_info(decoder_context_t* decoder_context, int media_type,
+				    struct decoder_stream_info* info);
+extern float decoder_get_duration(decoder_context_t* decoder_context);
+extern int64_t decoder_get_bit_rate(decoder_context_t* decoder_context);
+/* Bytes the container index attributes to the range, -1 when it has no usable index. */
+extern int64_t decoder_get_range_size(decoder_context_t* decoder_context, float start_ts, float end_ts);
+
+/* Wall microseconds from opening to the first frame inside the range, -1 before it. */
+extern int64_t decoder_get_first_frame_time(decoder_context_t* decoder_context);
+
 extern frame_t* decoder_next_frame(decoder_context_t* decoder_context);
 
 #endif
@@ -1,16 +1,24 @@
 #include "encoder.h"
+#include "decoder.h"
+#include "encoderpool.h"
+#include "h264idr.h"
+#include "interleaver.h"
+#include "pacer.h"
 #include "common/error.h"
+#include "common/trace.h"
 
 #include <libavutil/opt.h>
 #include <libavutil/avassert.h>
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libswresample/swresample.h>
+#include <libavutil/time.h>
 
 #include <stdio.h>
 
 typedef struct _encoder_context {
   AVFormatContext* format_context;
+  interleaver_context_t* interleaver_context;
   
   union {
     AVCodecContext* codec_context_table[2];
@@ -19,6 +27,18 @@ typedef struct _encoder_context {
       AVCodecContext* audio_codec_context;
     };
   } media_context;
+
+  struct encoder_options options;
+
+  pacer_context_t* pacer_context; // NULL unless the speed follows a deadline
+  float schedule_start_ts;
+  int video_frames;               // sent to the current video codec context
+
+  encoder_pool_t* encoder_pool;   // NULL unless GOPs are encoded in parallel
+  AVCodecContext** pool_codec_contexts; // the first one is video_codec_context
+  h264idr_context_t* h264idr_context;   // renumbers the IDR pictures of the pooled contexts
+
+  int audio_copy;                 // audio packets are copied, there is no audio codec context
 } encoder_context_t;
 
 int samples_count = 0;
@@ -28,11 +48,33 @@ const enum AVCodecID avcodec_id_table[] = {
   AV_CODEC_ID_AC3,
 };
 
+#define ENCODER_VIDEO_BIT_RATE 1153000
+#define ENCODER_VIDEO_GOP_SIZE 1
+// Presets must not change the parameter sets already written to the container header,
+// in-band headers on every IDR cover what the pinned options do not
+#define ENCODER_VIDEO_ADAPTIVE_PARAMS "cabac=1:8x8dct=1:ref=1:bframes=0:weightp=0:repeat-headers=1"
+// Pooled contexts only see their own GOPs, a packet has to come out for every frame sent
+#define ENCODER_VIDEO_POOL_PARAMS "rc-lookahead=0:sync-lookahead=0:bframes=0"
+
+#define ENCODER_AUDIO_BIT_RATE 384000
+#define ENCODER_COPY_TIME_BASE ((AVRational){1, DECODER_TIME_BASE_DEN})
+
+#define ENCODER_DUPLICATE_KEEPALIVE 1.0f // seconds
+#define ENCODER_MAX_INTERLEAVE_DELAY 1000000 // microseconds a stream may lag before others stop waiting
+
 #define ENCODER_MEDIA_CONTEXT_TYPE_VIDEO ((int)AVMEDIA_TYPE_VIDEO)
 #define ENCODER_MEDIA_CONTEXT_TYPE_AUDIO ((int)AVMEDIA_TYPE_AUDIO)
 
 void allocate_encoder_context(encoder_context_t** encoder_context) {
   encoder_context_t* context = (encoder_context_t*)malloc(sizeof(encoder_context_t));
+  context->interleaver_context = NULL;
+  context->pacer_context = NULL;
+  context->schedule_start_ts = 0;
+  context->video_frames = 0;
+  context->encoder_pool = NULL;
+  context->pool_codec_contexts = NULL;
+  context->h264idr_context = NULL;
+  context->audio_copy = 0;
   *encoder_context = context;
 }
 
@@ -43,6 +85,50 @@ void open_encoder_format_context(encoder_context_t* encoder_context, const char*
   }
 }
 
+void set_video_codec_options(encoder_context_t* encoder_context, AVCodecContext* codec_context,
+			     const char* preset) {
+  codec_context->codec_id = avcodec_id_table[ENCODER_MEDIA_CONTEXT_TYPE_VIDEO];
+  codec_context->bit_rate = ENCODER_VIDEO_BIT_RATE;
+  codec_context->width = ENCODER_VIDEO_WIDTH;
+  codec_context->height = ENCODER_VIDEO_HEIGHT;
+  codec_context->time_base = (AVRational){1001, 24000};
+  codec_context->framerate = (AVRational){24000, 1001};
+  codec_context->gop_size = ENCODER_VIDEO_GOP_SIZE;
+  codec_context->pix_fmt = AV_PIX_FMT_YUV420P;
+
+  codec_context->thread_count = encoder_context->options.thread_count;
+  av_opt_set(codec_context->priv_data, "preset", preset, 0);
+  if (encoder_context->options.realtime_factor > 0) {
+    av_opt_set(codec_context->priv_data, "x264-params", ENCODER_VIDEO_ADAPTIVE_PARAMS, 0);
+  }
+  if (encoder_context->options.parallel_contexts > 1) {
+    // The parallelism comes from the pool, threads inside each context would only contend
+    codec_context->thread_count = 1;
+    codec_context->max_b_frames = 0;
+    av_opt_set(codec_context->priv_data, "x264-params", ENCODER_VIDEO_POOL_PARAMS, 0);
+  }
+}
+
+AVCodecContext* open_video_codec_context(encoder_context_t* encoder_context, const char* preset) {
+  int status = 0;
+  AVCodec* codec = avcodec_find_encoder(avcodec_id_table[ENCODER_MEDIA_CONTEXT_TYPE_VIDEO]);
+  AVCodecContext* codec_context = avcodec_alloc_context3(codec);
+  if (!codec_context) {
+    throw_error("Encoder's video codec context allocation failed.", -1);
+  }
+
+  set_video_codec_options(encoder_context, codec_context, preset);
+  if (encoder_context->format_context->oformat->flags & AVFMT_GLOBALHEADER)
+    codec_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+  status = avcodec_open2(codec_context, codec, NULL);
+  if (status < 0) {
+    avcodec_free_context(&codec_context);
+    throw_error("Could not open video/audio codec context to encoding.", status);
+  }
+  return codec_context;
+}
+
 void open_encoder_codec_context(encoder_context_t* encoder_context, int media_type) {
   int status = 0;
   AVCodec* codec = NULL;
@@ -66,25 +152,17 @@ void open_encoder_codec_context(encoder_context_t* encoder_context, int media_ty
 
   stream->id = encoder_context->format_context->nb_streams-1;
   if (media_type == ENCODER_MEDIA_CONTEXT_TYPE_VIDEO) {
-    codec_context->codec_id = avcodec_id_table[media_type];
-    codec_context->bit_rate = 1153000;
-    codec_context->width = 360;
-    codec_context->height = 200;
-    codec_context->time_base = (AVRational){1001, 24000};
-    codec_context->framerate = (AVRational){24000, 1001};
-    codec_context->gop_size = 1;
-    codec_context->pix_fmt = AV_PIX_FMT_YUV420P;
+    set_video_codec_options(encoder_context, codec_context, encoder_context->options.preset);
 
     stream->start_time = -7;
     stream->time_base = (AVRational){1, 1000};
     stream->r_frame_rate = codec_context->framerate;
     stream->avg_frame_rate = codec_context->framerate;
-    av_opt_set(codec_context->priv_data, "preset", "slow", 0);
     
   } else if (media_type == ENCODER_MEDIA_CONTEXT_TYPE_AUDIO) {
-    codec_context->bit_rate = 384000;
+    codec_context->bit_rate = ENCODER_AUDIO_BIT_RATE;
     codec_context->sample_fmt = AV_SAMPLE_FMT_FLTP;
-    codec_context->sample_rate = 48000;
+    codec_context->sample_rate = ENCODER_AUDIO_SAMPLE_RATE;
     codec_context->channel_layout = AV_CH_LAYOUT_STEREO;
     codec_context->channels = av_get_channel_layout_nb_channels(codec_context->channel_layout);
   }
@@ -106,6 +184,25 @@ void open_encoder_codec_context(encoder_context_t* encoder_context, int media_ty
   encoder_context->media_context.codec_context_table[media_type] = codec_context;
 }
 
+/* The source stream goes out as it is, only its timestamps were shifted by the decoder */
+void open_encoder_audio_copy(encoder_context_t* encoder_context, const AVCodecParameters* codecpar) {
+  AVStream* stream = avformat_new_stream(encoder_context->format_context, NULL);
+  if (!stream) {
+    throw_error("Encoder's video/audio stream could not create.", -1);
+  }
+
+  int status = avcodec_parameters_copy(stream->codecpar, codecpar);
+  if (status < 0) {
+    throw_error("Failed to copy source audio codec parameters.", status);
+  }
+  stream->codecpar->codec_tag = 0;
+  stream->id = encoder_context->format_context->nb_streams-1;
+  stream->time_base = (AVRational){1, codecpar->sample_rate};
+
+  encoder_context->media_context.audio_codec_context = NULL;
+  encoder_context->audio_copy = 1;
+}
+
 void open_encoder_output_file(encoder_context_t* context, const char* filename) {
   int status = 0;
   AVOutputFormat* outformat = context->format_context->oformat;
@@ -123,99 +220,306 @@ void open_encoder_output_file(encoder_context_t* context, const char* filename)
   if (status < 0) {
     throw_error(av_err2str(status), status);
   }
+
+  interleaver_open(&context->interleaver_context, context->format_context,
+		   ENCODER_MAX_INTERLEAVE_DELAY);
+}
+
+/*
+ * Every pooled context has the same options, hence the same parameter sets as the stream header.
+ * Each one still runs its own IDR numbering, which is redone in output order, and its own ABR on
+ * its share of the frames: libx264 budgets frames by the fixed frame rate, so every context aims
+ * at the stream bit rate, but bursts in one are not evened out by the others.
+ */
+void open_encoder_pool(encoder_context_t* encoder_context) {
+  int nb_contexts = encoder_context->options.parallel_contexts;
+
+  encoder_context->pool_codec_contexts = (AVCodecContext**)malloc(nb_contexts * sizeof(AVCodecContext*));
+  if (!encoder_context->pool_codec_contexts) {
+    throw_error("Encoder pool allocation failed.", -1);
+  }
+
+  encoder_context->pool_codec_contexts[0] = encoder_context->media_context.video_codec_context;
+  for (int i = 1; i < nb_contexts; i++) {
+    encoder_context->pool_codec_contexts[i] =
+      open_video_codec_context(encoder_context, encoder_context->options.preset);
+  }
+
+  encoder_pool_open(&encoder_context->encoder_pool, (void**)encoder_context->pool_codec_contexts,
+		    nb_contexts, ENCODER_VIDEO_GOP_SIZE);
+
+  AVCodecContext* codec_context = encoder_context->media_context.video_codec_context;
+  h264idr_open(&encoder_context->h264idr_context, codec_context->extradata,
+	       codec_context->extradata_size);
+}
+
+void close_encoder_pool(encoder_context_t* encoder_context) {
+  encoder_pool_close(&encoder_context->encoder_pool);
+  h264idr_close(&encoder_context->h264idr_context);
+
+  for (int i = 1; i < encoder_context->options.parallel_contexts; i++) {
+    avcodec_free_context(&encoder_context->pool_codec_contexts[i]);
+  }
+  free(encoder_context->pool_codec_contexts);
+  encoder_context->pool_codec_contexts = NULL;
 }
 
-void encoder_open(encoder_context_t** encoder_context, const char* filename) {
+void encoder_init_options(struct encoder_options* options) {
+  options->preset = ENCODER_VIDEO_DEFAULT_PRESET;
+  options->thread_count = 0;
+  options->realtime_factor = 0;
+  options->parallel_contexts = 0;
+  options->audio_passthrough = 1;
+  options->duplicate_threshold = 0;
+  options->duplicate_keepalive = ENCODER_DUPLICATE_KEEPALIVE;
+}
+
+int encoder_can_copy_audio(const struct encoder_options* options, const void* codecpar) {
+  const AVCodecParameters* parameters = (const AVCodecParameters*)codecpar;
+
+  return options->audio_passthrough &&
+    parameters->codec_id == avcodec_id_table[ENCODER_MEDIA_CONTEXT_TYPE_AUDIO] &&
+    parameters->sample_rate == ENCODER_AUDIO_SAMPLE_RATE && parameters->channels == 2 &&
+    (!parameters->channel_layout || parameters->channel_layout == AV_CH_LAYOUT_STEREO);
+}
+
+void encoder_open(encoder_context_t** encoder_context, const char* filename,
+		  const struct encoder_options* options) {
+  encoder_open_copying_audio(encoder_context, filename, options, NULL);
+}
+
+void encoder_open_copying_audio(encoder_context_t** encoder_context, const char* filename,
+				const struct encoder_options* options, const void* audio_codecpar) {
   allocate_encoder_context(encoder_context);
+  if (options) {
+    (*encoder_context)->options = *options;
+  } else {
+    encoder_init_options(&(*encoder_context)->options);
+  }
+  if ((*encoder_context)->options.parallel_contexts > 1 &&
+      (*encoder_context)->options.realtime_factor > 0) {
+    throw_error("Parallel encoder contexts cannot follow a realtime factor.", -1);
+  }
   open_encoder_format_context(*encoder_context, filename);
 
   open_encoder_codec_context(*encoder_context, ENCODER_MEDIA_CONTEXT_TYPE_VIDEO);
-  open_encoder_codec_context(*encoder_context, ENCODER_MEDIA_CONTEXT_TYPE_AUDIO);
+  if (audio_codecpar) {
+    open_encoder_audio_copy(*encoder_context, (const AVCodecParameters*)audio_codecpar);
+  } else {
+    open_encoder_codec_context(*encoder_context, ENCODER_MEDIA_CONTEXT_TYPE_AUDIO);
+  }
+  if ((*encoder_context)->options.parallel_contexts > 1) {
+    open_encoder_pool(*encoder_context);
+  }
 
   open_encoder_output_file(*encoder_context, filename);
 }
 
-void encoder_close(encoder_context_t** encoder_context) {
-  encoder_context_t* context = *encoder_context;
+AVRational get_encoder_time_base(encoder_context_t* encoder_context, int media_type) {
+  if (media_type == ENCODER_MEDIA_CONTEXT_TYPE_AUDIO && encoder_context->audio_copy) {
+    return ENCODER_COPY_TIME_BASE;
+  }
+  return encoder_context->media_context.codec_context_table[media_type]->time_base;
+}
 
-  av_write_trailer(context->format_context);
-  
-  avcodec_free_context(&context->media_context.video_codec_context);
-  avcodec_free_context(&context->media_context.audio_codec_context);
-  avformat_free_context(context->format_context);
-  free(context);
+void write_encoder_packet(encoder_context_t* encoder_context, int media_type, AVPacket* avpacket) {
+  AVStream* avstream = encoder_context->format_context->streams[media_type];
 
-  context = NULL;
+  av_packet_rescale_ts(avpacket, get_encoder_time_base(encoder_context, media_type),
+		       avstream->time_base);
+  avpacket->stream_index = media_type;
+
+  interleaver_put_packet(encoder_context->interleaver_context, avpacket);
 }
 
-void encode_frame(encoder_context_t* encoder_context, frame_t* frame) {
+void write_encoder_packets(encoder_context_t* encoder_context, int media_type) {
   int status = 0;
-  struct frame_item* item = frame_get_item(frame);
-
-  AVFrame* avframe = (AVFrame*)item->buffer;
-  AVStream* avstream = encoder_context->format_context->streams[item->stream_id];
-  AVCodecContext* codec_context = encoder_context->media_context.codec_context_table[item->stream_id];
+  AVCodecContext* codec_context = encoder_context->media_context.codec_context_table[media_type];
 
   AVPacket* avpacket = av_packet_alloc();
   if (!avpacket) {
     throw_error("Packet allocation failed.", -1);
   }
 
-  status = avcodec_send_frame(codec_context, avframe);
-  if (status < 0) {
-    throw_error("Error sending a frame for encoding.", status);
-  }
-
   while (status >= 0) {
+    trace_begin("encode_receive", TRACE_NO_PTS);
     status = avcodec_receive_packet(codec_context, avpacket);
+    trace_end("encode_receive", status < 0 ? TRACE_NO_PTS : avpacket->pts);
     if (status == AVERROR(EAGAIN) || status == AVERROR_EOF) {
-      return;
+      break;
     } else if (status < 0) {
       throw_error("Error during encoding.", status);
     }
 
-    av_packet_rescale_ts(avpacket, codec_context->time_base, avstream->time_base);
-    avpacket->stream_index = item->stream_id;
+    write_encoder_packet(encoder_context, media_type, avpacket);
+    av_packet_unref(avpacket);
+  }
 
-    status = av_interleaved_write_frame(encoder_context->format_context, avpacket);
-    if (status < 0) {
-      throw_error("Error during writting to file.", status);
+  av_packet_free(&avpacket);
+}
+
+/* Pooled packets come back in pts order, wait only once the pool is being flushed */
+void write_encoder_pool_packets(encoder_context_t* encoder_context, int wait) {
+  AVPacket* avpacket = NULL;
+
+  while ((avpacket = (AVPacket*)encoder_pool_receive_packet(encoder_context->encoder_pool, wait))) {
+    h264idr_renumber_packet(encoder_context->h264idr_context, avpacket);
+    write_encoder_packet(encoder_context, ENCODER_MEDIA_CONTEXT_TYPE_VIDEO, avpacket);
+    av_packet_free(&avpacket);
+  }
+}
+
+void flush_encoder(encoder_context_t* encoder_context, int media_type) {
+  if (media_type == ENCODER_MEDIA_CONTEXT_TYPE_VIDEO && encoder_context->encoder_pool) {
+    encoder_pool_flush(encoder_context->encoder_pool);
+    write_encoder_pool_packets(encoder_context, 1);
+    return;
+  }
+  if (media_type == ENCODER_MEDIA_CONTEXT_TYPE_AUDIO && encoder_context->audio_copy) {
+    return;
+  }
+
+  AVCodecContext* codec_context = encoder_context->media_context.codec_context_table[media_type];
+
+  trace_begin("encode_send", TRACE_NO_PTS);
+  int status = avcodec_send_frame(codec_context, NULL);
+  trace_end("encode_send", TRACE_NO_PTS);
+  if (status < 0 && status != AVERROR_EOF) {
+    throw_error("Error flushing the encoder.", status);
+  }
+  write_encoder_packets(encoder_context, media_type);
+}
+
+/* The stream and its header stay, only the codec context behind it is replaced */
+void reopen_video_codec_context(encoder_context_t* encoder_context, const char* preset) {
+  AVCodecContext* codec_context = open_video_codec_context(encoder_context, preset);
+
+  flush_encoder(encoder_context, ENCODER_MEDIA_CONTEXT_TYPE_VIDEO);
+  avcodec_free_context(&encoder_context->media_context.video_codec_context);
+  encoder_context->media_context.video_codec_context = codec_context;
+  encoder_context->video_frames = 0;
+}
+
+void pace_video_frame(encoder_context_t* encoder_context, AVFrame* avframe) {
+  AVCodecContext* codec_context = encoder_context->media_context.video_codec_context;
+
+  // A new codec context starts with an IDR frame, only switch where a GOP starts anyway
+  if (!encoder_context->pacer_context || avframe->pts == AV_NOPTS_VALUE ||
+      encoder_context->video_frames % ENCODER_VIDEO_GOP_SIZE != 0) {
+    return;
+  }
+
+  float progress_ts = (float)(avframe->pts * av_q2d(codec_context->time_base)) -
+    encoder_context->schedule_start_ts;
+  const char* preset = pacer_update(encoder_context->pacer_context, progress_ts,
+				    av_gettime_relative());
+  if (preset) {
+    reopen_video_codec_context(encoder_context, preset);
+  }
+}
+
+void encode_frame(encoder_context_t* encoder_context, frame_t* frame) {
+  int status = 0;
+  struct frame_item* item = frame_get_item(frame);
+
+  if (frame_get_type(frame) == FRAME_PACKET_TYPE) {
+    write_encoder_packet(encoder_context, item->stream_id, (AVPacket*)item->buffer);
+    return;
+  }
+
+  AVFrame* avframe = (AVFrame*)item->buffer;
+  if (item->stream_id == ENCODER_MEDIA_CONTEXT_TYPE_VIDEO) {
+    pace_video_frame(encoder_context, avframe);
+    encoder_context->video_frames++;
+
+    if (encoder_context->encoder_pool) {
+      encoder_pool_send_frame(encoder_context->encoder_pool, avframe);
+      write_encoder_pool_packets(encoder_context, 0);
+      return;
     }
+  }
 
-    av_packet_unref(avpacket);
+  AVCodecContext* codec_context = encoder_context->media_context.codec_context_table[item->stream_id];
+
+  trace_begin("encode_send", avframe->pts);
+  status = avcodec_send_frame(codec_context, avframe);
+  trace_end("encode_send", TRACE_NO_PTS);
+  if (status < 0) {
+    throw_error("Error sending a frame for encoding.", status);
   }
+
+  write_encoder_packets(encoder_context, item->stream_id);
 }
 
-void encoder_set_frames(encoder_context_t* encoder_context, frame_t* video_frame, frame_t* audio_frame){
-  AVCodecContext* video_codec_context = encoder_context->media_context.video_codec_context;
-  AVCodecContext* audio_codec_context = encoder_context->media_context.audio_codec_context;
+void encoder_close(encoder_context_t** encoder_context) {
+  encoder_context_t* context = *encoder_context;
+
+  // Frames still held in the encoder lookahead would be lost without draining
+  flush_encoder(context, ENCODER_MEDIA_CONTEXT_TYPE_VIDEO);
+  interleaver_finish_stream(context->interleaver_context, ENCODER_MEDIA_CONTEXT_TYPE_VIDEO);
+  flush_encoder(context, ENCODER_MEDIA_CONTEXT_TYPE_AUDIO);
+  interleaver_close(&context->interleaver_context);
+  if (context->encoder_pool) {
+    close_encoder_pool(context);
+  }
+
+  av_write_trailer(context->format_context);
+  if (!(context->format_context->oformat->flags & AVFMT_NOFILE)) {
+    avio_closep(&context->format_context->pb);
+  }
   
-  while (video_frame || audio_frame) {
-    AVFrame* video_avframe = NULL;
-    AVFrame* audio_avframe = NULL;
+  avcodec_free_context(&context->media_context.video_codec_context);
+  avcodec_free_context(&context->media_context.audio_codec_context);
+  avformat_free_context(context->format_context);
+  if (context->pacer_context) {
+    pacer_close(&context->pacer_context);
+  }
+  free(context);
 
-    if (video_frame) {
-      struct frame_item* video_item = frame_get_item(video_frame);
-      video_avframe = (AVFrame*)video_item->buffer;
-    }
+  *encoder_context = NULL;
+}
 
-    if (audio_frame) {
-      struct frame_item* audio_item = frame_get_item(audio_frame);
-      audio_avframe = (AVFrame*)audio_item->buffer;
-    }
-    
-    if (video_frame &&
-	(!audio_frame || av_compare_ts(video_avframe->pts, video_codec_context->time_base,
-				       audio_avframe->pts, audio_codec_context->time_base) <= 0)) {
-      encode_frame(encoder_context, video_frame);
-      video_frame = frame_next(video_frame);
-    } else {
-      encode_frame(encoder_context, audio_frame);
-      audio_frame = frame_next(audio_frame);
-    }
+void encoder_next_frame(encoder_context_t* encoder_context, frame_t* frame) {
+  encode_frame(encoder_context, frame);
+}
+
+void encoder_set_schedule(encoder_context_t* encoder_context, float start_ts, float end_ts,
+			  int64_t start_time) {
+  float factor = encoder_context->options.realtime_factor;
+  if (factor <= 0) {
+    return;
   }
+
+  int64_t deadline = start_time + (int64_t)((double)factor * (end_ts - start_ts) * 1e6);
+  encoder_context->schedule_start_ts = start_ts;
+  pacer_open(&encoder_context->pacer_context, encoder_context->options.preset, end_ts - start_ts,
+	     deadline);
 }
 
 void* encoder_get_codec_context(encoder_context_t* encoder_context, int media_type) {
   return encoder_context->media_context.codec_context_table[media_type];
 }
+
+void encoder_get_settings(const struct encoder_options* options, char* buffer, size_t size) {
+  char pacing[32] = "";
+  char parallel[32] = "";
+  char duplicates[48] = "";
+
+  // Adaptive outputs depend on the deadline, fixed ones keep their existing keys
+  if (options->realtime_factor > 0) {
+    snprintf(pacing, sizeof(pacing), ":rt%.2f", options->realtime_factor);
+  }
+  if (options->parallel_contexts > 1) {
+    snprintf(parallel, sizeof(parallel), ":ctx%d", options->parallel_contexts);
+  }
+  if (options->duplicate_threshold > 0) {
+    snprintf(duplicates, sizeof(duplicates), ":dup%.2f/%.2f", options->duplicate_threshold,
+	     options->duplicate_keepalive);
+  }
+  snprintf(buffer, size, "%s:%dx%d:%d:gop%d:%s%s%s%s|%s:%d:%d:stereo:fltp%s",
+	   avcodec_get_name(avcodec_id_table[ENCODER_MEDIA_CONTEXT_TYPE_VIDEO]),
+	   ENCODER_VIDEO_WIDTH, ENCODER_VIDEO_HEIGHT, ENCODER_VIDEO_BIT_RATE,
+	   ENCODER_VIDEO_GOP_SIZE, options->preset, pacing, parallel, duplicates,
+	   avcodec_get_name(avcodec_id_table[ENCODER_MEDIA_CONTEXT_TYPE_AUDIO]),
+	   ENCODER_AUDIO_BIT_RATE, ENCODER_AUDIO_SAMPLE_RATE, options->audio_passthrough ? ":copy" : "");
+}
@@ -3,14 +3,49 @@
 
 #include "frame.h"
 
+#include <stddef.h>
+#include <stdint.h>
+
+#define ENCODER_VIDEO_WIDTH 360
+#define ENCODER_VIDEO_HEIGHT 200
+#define ENCODER_AUDIO_SAMPLE_RATE 48000
+#define ENCODER_AUDIO_FRAME_SIZE 1536 // samples per AC3 frame
+#define ENCODER_VIDEO_DEFAULT_PRESET "slow"
+
 typedef struct _encoder_context encoder_context_t;
 
-extern void encoder_open(encoder_context_t** encoder_context, const char* filename);
+struct encoder_options {
+  const char* preset; // x264 preset of the video encoder
+  int thread_count;   // 0 lets the codec pick
+  float realtime_factor; // > 0 adapts the preset to finish within this many times the content duration
+  int parallel_contexts; // > 1 encodes closed GOPs round-robin on that many video codec contexts
+  int audio_passthrough; // source audio already in the output format is copied instead of encoded
+  float duplicate_threshold; // > 0 drops video frames within this mean difference per byte of the last kept one
+  float duplicate_keepalive; // seconds after which a duplicate is kept anyway
+};
+
+extern void encoder_init_options(struct encoder_options* options);
+
+extern void encoder_open(encoder_context_t** encoder_context, const char* filename,
+			 const struct encoder_options* options);
+/* Same, with audio_codecpar (AVCodecParameters) the source audio stream copied packet by packet,
+   encoder_get_codec_context has no audio context then. */
+extern void encoder_open_copying_audio(encoder_context_t** encoder_context, const char* filename,
+				       const struct encoder_options* options, const void* audio_codecpar);
 extern void encoder_close(encoder_context_t** encoder_context);
 
+/* Encodes a frame (or copies a packet) right away, the streams are interleaved by dts on output
+   so they may be fed in any order. */
 extern void encoder_next_frame(encoder_context_t* encoder_context, frame_t* frame);
-extern void encoder_set_frames(encoder_context_t* encoder_context, frame_t* video_frame,
-			       frame_t* audio_frame);
+/* Content from start_ts to end_ts (output time) has to be encoded within realtime_factor times its
+   duration after start_time (av_gettime_relative). Does nothing without a realtime_factor. */
+extern void encoder_set_schedule(encoder_context_t* encoder_context, float start_ts, float end_ts,
+				 int64_t start_time);
+/* Whether audio with these AVCodecParameters can be copied under the options. */
+extern int encoder_can_copy_audio(const struct encoder_options* options, const void* codecpar);
 extern void* encoder_get_codec_context(encoder_context_t* encoder_context, int media_type);
 
+/* Describes every setting that affects the encoded output, used to key cached results. */
+extern void encoder_get_settings(const struct encoder_options* options, char* buffer, size_t size);
+
 #endif
@@ -0,0 +1,339 @@
+#include "encoderpool.h"
+#include "common/error.h"
+#include "common/trace.h"
+
+#include <libavcodec/avcodec.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define ENCODER_POOL_QUEUE_SIZE 8 // frames waiting per codec context
+
+struct encoder_pool_input {
+  AVFrame* avframe;
+  int64_t seq;
+};
+
+struct encoder_pool_output {
+  AVPacket* avpacket;
+  int64_t seq;
+};
+
+struct encoder_pool_worker {
+  encoder_pool_t* encoder_pool;
+  pthread_t thread;
+  pthread_cond_t work_cond;
+  AVCodecContext* codec_context;
+
+  struct encoder_pool_input input[ENCODER_POOL_QUEUE_SIZE];
+  int input_head;
+  int input_count;
+  int flushing;
+
+  // Frames inside the codec, matched to their packet by pts (worker thread only)
+  struct encoder_pool_input* pending;
+  int pending_head;
+  int pending_count;
+  int pending_capacity;
+
+  // Encoded packets in pts order, every frame up to done_seq has its packet in there
+  struct encoder_pool_output* output;
+  int output_head;
+  int output_count;
+  int output_capacity;
+  int64_t done_seq;
+};
+
+typedef struct encoder_pool {
+  int nb_workers;
+  int gop_size;
+  struct encoder_pool_worker* workers;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t space_cond;
+  pthread_cond_t done_cond;
+
+  int64_t sent_seq; // frames sent so far
+  int64_t next_seq; // next frame to return the packet of
+} encoder_pool_t;
+
+static struct encoder_pool_worker* find_worker(encoder_pool_t* encoder_pool, int64_t seq) {
+  return &encoder_pool->workers[(seq / encoder_pool->gop_size) % encoder_pool->nb_workers];
+}
+
+static void push_pending(struct encoder_pool_worker* worker, struct encoder_pool_input item) {
+  if (worker->pending_count == worker->pending_capacity) {
+    int capacity = worker->pending_capacity ? 2 * worker->pending_capacity : ENCODER_POOL_QUEUE_SIZE;
+    struct encoder_pool_input* pending =
+      (struct encoder_pool_input*)malloc(capacity * sizeof(struct encoder_pool_input));
+    if (!pending) {
+      throw_error("Encoder pool allocation failed.", -1);
+    }
+    for (int i = 0; i < worker->pending_count; i++) {
+      pending[i] = worker->pending[(worker->pending_head + i) % worker->pending_capacity];
+    }
+    free(worker->pending);
+    worker->pending = pending;
+    worker->pending_head = 0;
+    worker->pending_capacity = capacity;
+  }
+
+  worker->pending[(worker->pending_head + worker->pending_count) % worker->pending_capacity] = item;
+  worker->pending_count++;
+}
+
+/* Frames sent before the one the packet belongs to are done, with or without a packet */
+static int64_t pop_pending(struct encoder_pool_worker* worker, int64_t pts) {
+  int64_t seq = -1;
+
+  while (worker->pending_count > 0) {
+    struct encoder_pool_input* item = &worker->pending[worker->pending_head];
+    if (seq >= 0 && (pts == AV_NOPTS_VALUE || item->avframe->pts > pts)) {
+      break;
+    }
+    seq = item->seq;
+    av_frame_free(&item->avframe);
+    worker->pending_head = (worker->pending_head + 1) % worker->pending_capacity;
+    worker->pending_count--;
+  }
+  return seq;
+}
+
+/* Called with the pool mutex held */
+static void push_output(struct encoder_pool_worker* worker, struct encoder_pool_output item) {
+  if (worker->output_count == worker->output_capacity) {
+    int capacity = worker->output_capacity ? 2 * worker->output_capacity : ENCODER_POOL_QUEUE_SIZE;
+    struct encoder_pool_output* output =
+      (struct encoder_pool_output*)malloc(capacity * sizeof(struct encoder_pool_output));
+    if (!output) {
+      throw_error("Encoder pool allocation failed.", -1);
+    }
+    for (int i = 0; i < worker->output_count; i++) {
+      output[i] = worker->output[(worker->output_head + i) % worker->output_capacity];
+    }
+    free(worker->output);
+    worker->output = output;
+    worker->output_head = 0;
+    worker->output_capacity = capacity;
+  }
+
+  worker->output[(worker->output_head + worker->output_count) % worker->output_capacity] = item;
+  worker->output_count++;
+}
+
+static void receive_packets(struct encoder_pool_worker* worker) {
+  encoder_pool_t* encoder_pool = worker->encoder_pool;
+  int status = 0;
+
+  while (status >= 0) {
+    AVPacket* avpacket = av_packet_alloc();
+    if (!avpacket) {
+      throw_error("Packet allocation failed.", -1);
+    }
+
+    trace_begin("encode_receive", TRACE_NO_PTS);
+    status = avcodec_receive_packet(worker->codec_context, avpacket);
+    trace_end("encode_receive", status < 0 ? TRACE_NO_PTS : avpacket->pts);
+    if (status == AVERROR(EAGAIN) || status == AVERROR_EOF) {
+      av_packet_free(&avpacket);
+      break;
+    } else if (status < 0) {
+      throw_error("Error during encoding.", status);
+    }
+
+    struct encoder_pool_output item = { avpacket, pop_pending(worker, avpacket->pts) };
+    if (item.seq < 0) {
+      throw_error("Encoder pool got a packet for no frame.", -1);
+    }
+
+    pthread_mutex_lock(&encoder_pool->mutex);
+    push_output(worker, item);
+    worker->done_seq = item.seq;
+    pthread_cond_signal(&encoder_pool->done_cond);
+    pthread_mutex_unlock(&encoder_pool->mutex);
+  }
+}
+
+static void* run_worker(void* argument) {
+  struct encoder_pool_worker* worker = (struct encoder_pool_worker*)argument;
+  encoder_pool_t* encoder_pool = worker->encoder_pool;
+  int64_t last_seq = -1;
+
+  pthread_mutex_lock(&encoder_pool->mutex);
+  while (1) {
+    while (!worker->input_count && !worker->flushing) {
+      pthread_cond_wait(&worker->work_cond, &encoder_pool->mutex);
+    }
+
+    if (!worker->input_count) {
+      break;
+    }
+
+    struct encoder_pool_input item = worker->input[worker->input_head];
+    worker->input_head = (worker->input_head + 1) % ENCODER_POOL_QUEUE_SIZE;
+    worker->input_count--;
+    pthread_cond_broadcast(&encoder_pool->space_cond);
+    pthread_mutex_unlock(&encoder_pool->mutex);
+
+    trace_begin("encode_send", item.avframe->pts);
+    int status = avcodec_send_frame(worker->codec_context, item.avframe);
+    trace_end("encode_send", TRACE_NO_PTS);
+    if (status < 0) {
+      throw_error("Error sending a frame for encoding.", status);
+    }
+    push_pending(worker, item);
+    last_seq = item.seq;
+    receive_packets(worker);
+
+    pthread_mutex_lock(&encoder_pool->mutex);
+  }
+  pthread_mutex_unlock(&encoder_pool->mutex);
+
+  trace_begin("encode_send", TRACE_NO_PTS);
+  int status = avcodec_send_frame(worker->codec_context, NULL);
+  trace_end("encode_send", TRACE_NO_PTS);
+  if (status < 0 && status != AVERROR_EOF) {
+    throw_error("Error flushing the encoder.", status);
+  }
+  receive_packets(worker);
+
+  // Whatever is still pending never got a packet
+  while (worker->pending_count > 0) {
+    av_frame_free(&worker->pending[worker->pending_head].avframe);
+    worker->pending_head = (worker->pending_head + 1) % worker->pending_capacity;
+    worker->pending_count--;
+  }
+
+  pthread_mutex_lock(&encoder_pool->mutex);
+  worker->done_seq = last_seq > worker->done_seq ? last_seq : worker->done_seq;
+  pthread_cond_signal(&encoder_pool->done_cond);
+  pthread_mutex_unlock(&encoder_pool->mutex);
+  return NULL;
+}
+
+void encoder_pool_open(encoder_pool_t** encoder_pool, void** codec_contexts, int nb_contexts,
+		       int gop_size) {
+  encoder_pool_t* pool = (encoder_pool_t*)calloc(1, sizeof(encoder_pool_t));
+  if (!pool) {
+    throw_error("Encoder pool allocation failed.", -1);
+  }
+
+  pool->nb_workers = nb_contexts;
+  pool->gop_size = gop_size > 0 ? gop_size : 1;
+  pool->workers = (struct encoder_pool_worker*)calloc(nb_contexts, sizeof(struct encoder_pool_worker));
+  if (!pool->workers) {
+    throw_error("Encoder pool allocation failed.", -1);
+  }
+
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->space_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+
+  for (int i = 0; i < nb_contexts; i++) {
+    struct encoder_pool_worker* worker = &pool->workers[i];
+    worker->encoder_pool = pool;
+    worker->codec_context = (AVCodecContext*)codec_contexts[i];
+    worker->done_seq = -1;
+    pthread_cond_init(&worker->work_cond, NULL);
+
+    if (pthread_create(&worker->thread, NULL, run_worker, worker) != 0) {
+      throw_error("Encoder pool thread creation failed.", -1);
+    }
+  }
+
+  *encoder_pool = pool;
+}
+
+void encoder_pool_flush(encoder_pool_t* encoder_pool) {
+  pthread_mutex_lock(&encoder_pool->mutex);
+  for (int i = 0; i < encoder_pool->nb_workers; i++) {
+    encoder_pool->workers[i].flushing = 1;
+    pthread_cond_signal(&encoder_pool->workers[i].work_cond);
+  }
+  pthread_mutex_unlock(&encoder_pool->mutex);
+}
+
+void encoder_pool_close(encoder_pool_t** encoder_pool) {
+  encoder_pool_t* pool = *encoder_pool;
+
+  encoder_pool_flush(pool);
+  for (int i = 0; i < pool->nb_workers; i++) {
+    struct encoder_pool_worker* worker = &pool->workers[i];
+    pthread_join(worker->thread, NULL);
+    pthread_cond_destroy(&worker->work_cond);
+
+    while (worker->output_count > 0) {
+      av_packet_free(&worker->output[worker->output_head].avpacket);
+      worker->output_head = (worker->output_head + 1) % worker->output_capacity;
+      worker->output_count--;
+    }
+    free(worker->pending);
+    free(worker->output);
+  }
+
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->space_cond);
+  pthread_cond_destroy(&pool->done_cond);
+  free(pool->workers);
+  free(pool);
+
+  *encoder_pool = NULL;
+}
+
+void encoder_pool_send_frame(encoder_pool_t* encoder_pool, void* avframe) {
+  struct encoder_pool_input item;
+  struct encoder_pool_worker* worker = NULL;
+
+  // The frame may be freed as soon as this returns, the worker gets its own reference
+  item.avframe = av_frame_clone((AVFrame*)avframe);
+  if (!item.avframe) {
+    throw_error("Encoder pool frame reference failed.", -1);
+  }
+
+  // A full queue means the workers are behind, the wait shows up as a stall in traces
+  trace_begin("pool_wait", item.avframe->pts);
+  pthread_mutex_lock(&encoder_pool->mutex);
+  item.seq = encoder_pool->sent_seq++;
+  worker = find_worker(encoder_pool, item.seq);
+
+  while (worker->input_count == ENCODER_POOL_QUEUE_SIZE) {
+    pthread_cond_wait(&encoder_pool->space_cond, &encoder_pool->mutex);
+  }
+  trace_end("pool_wait", TRACE_NO_PTS);
+  worker->input[(worker->input_head + worker->input_count) % ENCODER_POOL_QUEUE_SIZE] = item;
+  worker->input_count++;
+  pthread_cond_signal(&worker->work_cond);
+  pthread_mutex_unlock(&encoder_pool->mutex);
+}
+
+void* encoder_pool_receive_packet(encoder_pool_t* encoder_pool, int wait) {
+  AVPacket* avpacket = NULL;
+
+  pthread_mutex_lock(&encoder_pool->mutex);
+  while (encoder_pool->next_seq < encoder_pool->sent_seq) {
+    struct encoder_pool_worker* worker = find_worker(encoder_pool, encoder_pool->next_seq);
+
+    if (worker->output_count > 0 &&
+	worker->output[worker->output_head].seq == encoder_pool->next_seq) {
+      avpacket = worker->output[worker->output_head].avpacket;
+      worker->output_head = (worker->output_head + 1) % worker->output_capacity;
+      worker->output_count--;
+      encoder_pool->next_seq++;
+      break;
+    }
+
+    // Done without a packet of its own, the codec dropped it
+    if (worker->done_seq >= encoder_pool->next_seq) {
+      encoder_pool->next_seq++;
+      continue;
+    }
+
+    if (!wait) {
+      break;
+    }
+    pthread_cond_wait(&encoder_pool->done_cond, &encoder_pool->mutex);
+  }
+  pthread_mutex_unlock(&encoder_pool->mutex);
+
+  return avpacket;
+}
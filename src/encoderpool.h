@@ -0,0 +1,26 @@
+#ifndef _ENCODERPOOL_H_
+#define _ENCODERPOOL_H_
+
+typedef struct encoder_pool encoder_pool_t;
+
+/*
+ * Encodes closed GOPs of gop_size frames on nb_contexts opened video codec contexts, each on its
+ * own thread, GOPs handed out round-robin. The codec contexts stay owned by the caller and must
+ * output one packet per frame in pts order (no B-frames).
+ */
+extern void encoder_pool_open(encoder_pool_t** encoder_pool, void** codec_contexts, int nb_contexts,
+			      int gop_size);
+extern void encoder_pool_close(encoder_pool_t** encoder_pool);
+
+/* Queues a reference to the AVFrame, blocks while the context it goes to has a full queue. */
+extern void encoder_pool_send_frame(encoder_pool_t* encoder_pool, void* avframe);
+
+/* Drains every codec context once the frames sent so far have been encoded. */
+extern void encoder_pool_flush(encoder_pool_t* encoder_pool);
+
+/* Returns the next AVPacket in pts order, to be freed by the caller, or NULL when it is not encoded
+   yet. With wait, only after encoder_pool_flush, it blocks for it instead and NULL means every
+   frame sent has been returned. */
+extern void* encoder_pool_receive_packet(encoder_pool_t* encoder_pool, int wait);
+
+#endif
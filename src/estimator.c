@@ -0,0 +1,319 @@
+#include "estimator.h"
+#include "decoder.h"
+#include "job.h"
+#include "pacer.h"
+#include "common/error.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#define ESTIMATOR_FRAME_BYTES (ENCODER_VIDEO_WIDTH * ENCODER_VIDEO_HEIGHT * 3 / 2)
+#define ESTIMATOR_BUFFERED_FRAMES 4 // scaled frames between the rescaler and the encoder
+#define ESTIMATOR_INTERLEAVE_SECONDS 1.0 // output the encoder's interleaver may hold back
+#define ESTIMATOR_BITSTREAM_SHARE 0.3 // part of the decode time going by input bytes, not pixels
+#define ESTIMATOR_PRESET_SIZE 32
+
+/* Cost coefficients of this machine, all CPU times in microseconds. */
+struct estimator_calibration {
+  char preset[ESTIMATOR_PRESET_SIZE]; // x264 preset the encode cost was measured with
+  double decode_us_per_mpixel;  // demuxing and decoding both streams per source megapixel
+  double decode_us_per_mbyte;   // entropy decoding per megabyte of input
+  double scale_us_per_mpixel;   // rescaling per source megapixel
+  double resample_us_per_second;
+  double audio_encode_us_per_second; // encoding resampled audio, nothing when it is copied
+  double encode_us_per_frame;   // encoding video and muxing both streams per output video frame
+  double output_bytes_per_second;
+  double base_memory_bytes;     // peak resident size apart from the frames and packets in flight
+};
+
+/* Rough numbers of a single modern core, good enough to rank jobs until a calibration is run */
+static const struct estimator_calibration default_calibration = {
+  .preset = ENCODER_VIDEO_DEFAULT_PRESET,
+  .decode_us_per_mpixel = 1750,
+  .decode_us_per_mbyte = 60000,
+  .scale_us_per_mpixel = 800,
+  .resample_us_per_second = 200,
+  .audio_encode_us_per_second = 3000,
+  .encode_us_per_frame = 3000,
+  .output_bytes_per_second = 192125,
+  .base_memory_bytes = 32 << 20,
+};
+
+struct estimator_source {
+  struct decoder_stream_info video;
+  struct decoder_stream_info audio;
+  int audio_copied; // the job would copy the audio packets instead of re-encoding them
+  int64_t input_bytes;
+  const char* input_bytes_source; // "index", "bitrate" or "unknown"
+};
+
+static void probe_source(const char* input_filename, float start_ts, float end_ts,
+			 const struct encoder_options* encoder_options,
+			 struct estimator_source* source) {
+  decoder_context_t* decoder_context = NULL;
+  struct encoder_options default_options;
+
+  if (!encoder_options) {
+    encoder_init_options(&default_options);
+    encoder_options = &default_options;
+  }
+
+  // The codec names are static strings, they outlive the decoder
+  decoder_probe(&decoder_context, input_filename);
+  decoder_get_stream_info(decoder_context, FRAME_VIDEO_TYPE, &source->video);
+  decoder_get_stream_info(decoder_context, FRAME_AUDIO_TYPE, &source->audio);
+  source->audio_copied = encoder_can_copy_audio(encoder_options,
+						decoder_get_codec_parameters(decoder_context,
+									     FRAME_AUDIO_TYPE));
+
+  source->input_bytes = decoder_get_range_size(decoder_context, start_ts, end_ts);
+  source->input_bytes_source = "index";
+  if (source->input_bytes < 0) {
+    int64_t bit_rate = decoder_get_bit_rate(decoder_context);
+    source->input_bytes = bit_rate > 0 ? (int64_t)(bit_rate / 8 * (double)(end_ts - start_ts)) : -1;
+    source->input_bytes_source = bit_rate > 0 ? "bitrate" : "unknown";
+  }
+
+  decoder_close(&decoder_context);
+}
+
+static double get_video_frames(const struct estimator_source* source, float duration) {
+  return source->video.frame_rate * duration;
+}
+
+static double get_video_mpixels(const struct estimator_source* source, double frames) {
+  return frames * source->video.width * source->video.height / 1e6;
+}
+
+/* Frames stream through the encoder, only a few are in flight and the interleaver holds about a
+   second of packets, whatever the length of the range */
+static double get_buffered_bytes(const struct estimator_calibration* calibration) {
+  return ESTIMATOR_BUFFERED_FRAMES * ESTIMATOR_FRAME_BYTES +
+    calibration->output_bytes_per_second * ESTIMATOR_INTERLEAVE_SECONDS;
+}
+
+static int read_calibration(const char* filename, struct estimator_calibration* calibration) {
+  char line[128];
+  int fields = 0;
+
+  FILE* file = fopen(filename, "r");
+  if (!file) {
+    return 0;
+  }
+
+  while (fgets(line, sizeof(line), file)) {
+    fields += sscanf(line, "preset=%31s", calibration->preset);
+    fields += sscanf(line, "decode_us_per_mpixel=%lf", &calibration->decode_us_per_mpixel);
+    fields += sscanf(line, "decode_us_per_mbyte=%lf", &calibration->decode_us_per_mbyte);
+    fields += sscanf(line, "scale_us_per_mpixel=%lf", &calibration->scale_us_per_mpixel);
+    fields += sscanf(line, "resample_us_per_second=%lf", &calibration->resample_us_per_second);
+    fields += sscanf(line, "audio_encode_us_per_second=%lf",
+		     &calibration->audio_encode_us_per_second);
+    fields += sscanf(line, "encode_us_per_frame=%lf", &calibration->encode_us_per_frame);
+    fields += sscanf(line, "output_bytes_per_second=%lf", &calibration->output_bytes_per_second);
+    fields += sscanf(line, "base_memory_bytes=%lf", &calibration->base_memory_bytes);
+  }
+
+  fclose(file);
+  return fields == 9;
+}
+
+static void write_calibration(const char* filename, const struct estimator_calibration* calibration) {
+  FILE* file = fopen(filename, "w");
+  if (!file) {
+    throw_error("Could not write the calibration file.", -1);
+  }
+
+  fprintf(file, "preset=%s\n", calibration->preset);
+  fprintf(file, "decode_us_per_mpixel=%.3f\n", calibration->decode_us_per_mpixel);
+  fprintf(file, "decode_us_per_mbyte=%.3f\n", calibration->decode_us_per_mbyte);
+  fprintf(file, "scale_us_per_mpixel=%.3f\n", calibration->scale_us_per_mpixel);
+  fprintf(file, "resample_us_per_second=%.3f\n", calibration->resample_us_per_second);
+  fprintf(file, "audio_encode_us_per_second=%.3f\n", calibration->audio_encode_us_per_second);
+  fprintf(file, "encode_us_per_frame=%.3f\n", calibration->encode_us_per_frame);
+  fprintf(file, "output_bytes_per_second=%.3f\n", calibration->output_bytes_per_second);
+  fprintf(file, "base_memory_bytes=%.0f\n", calibration->base_memory_bytes);
+
+  if (fclose(file) != 0) {
+    throw_error("Could not write the calibration file.", -1);
+  }
+}
+
+void estimator_calibrate(const char* input_filename, float start_ts, float end_ts,
+			 const char* output_filename, const char* calibration_filename,
+			 const struct encoder_options* encoder_options) {
+  struct estimator_source source;
+  struct estimator_calibration calibration;
+  struct encoder_options calibration_options;
+  struct job_segment segment;
+  struct job_stats stats;
+  struct rusage usage;
+  struct stat output_stat;
+  float duration = end_ts - start_ts;
+
+  if (duration <= 0) {
+    throw_error("Calibration range must not be empty.", -1);
+  }
+
+  // Coefficients describe the machine, dropped duplicates would make them describe the content
+  // and copied audio would leave the audio coefficients unmeasured
+  if (encoder_options) {
+    calibration_options = *encoder_options;
+  } else {
+    encoder_init_options(&calibration_options);
+  }
+  calibration_options.duplicate_threshold = 0;
+  calibration_options.audio_passthrough = 0;
+  // One preset for the whole run, the pacer would mix several into the encode cost
+  calibration_options.realtime_factor = 0;
+
+  probe_source(input_filename, start_ts, end_ts, &calibration_options, &source);
+
+  job_init_segment(&segment, input_filename, start_ts, end_ts);
+  segment.encoder_options = &calibration_options;
+  segment.stats = &stats;
+  job_transcode(&segment, output_filename);
+
+  if (stats.video_frames == 0 || stat(output_filename, &output_stat) < 0) {
+    throw_error("Calibration run produced no output.", -1);
+  }
+  getrusage(RUSAGE_SELF, &usage);
+
+  double mpixels = get_video_mpixels(&source, stats.video_frames);
+  if (mpixels <= 0) {
+    throw_error("Calibration input has no video dimensions.", -1);
+  }
+
+  snprintf(calibration.preset, sizeof(calibration.preset), "%s", calibration_options.preset);
+  // One run cannot tell pixels from bytes apart, the decode time is split by a fixed share. All of
+  // it goes by pixels when the input size of the range is unknown.
+  if (source.input_bytes > 0) {
+    calibration.decode_us_per_mpixel = stats.decode_time * (1 - ESTIMATOR_BITSTREAM_SHARE) / mpixels;
+    calibration.decode_us_per_mbyte = stats.decode_time * ESTIMATOR_BITSTREAM_SHARE /
+      (source.input_bytes / 1e6);
+  } else {
+    calibration.decode_us_per_mpixel = stats.decode_time / mpixels;
+    calibration.decode_us_per_mbyte = 0;
+  }
+  calibration.scale_us_per_mpixel = stats.scale_time / mpixels;
+  calibration.resample_us_per_second = stats.resample_time / duration;
+  calibration.audio_encode_us_per_second = stats.audio_encode_time / duration;
+  calibration.encode_us_per_frame = (double)(stats.encode_time - stats.audio_encode_time) /
+    stats.video_frames;
+  calibration.output_bytes_per_second = output_stat.st_size / duration;
+  calibration.base_memory_bytes = (double)usage.ru_maxrss * 1024 -
+    get_buffered_bytes(&calibration);
+  if (calibration.base_memory_bytes < default_calibration.base_memory_bytes) {
+    calibration.base_memory_bytes = default_calibration.base_memory_bytes;
+  }
+
+  write_calibration(calibration_filename, &calibration);
+}
+
+static void print_json_string(const char* string) {
+  putchar('"');
+  for (const unsigned char* c = (const unsigned char*)string; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      printf("\\%c", *c);
+    } else if (*c < 0x20) {
+      printf("\\u%04x", *c);
+    } else {
+      putchar(*c);
+    }
+  }
+  putchar('"');
+}
+
+/* Decoding goes by the pixels and by the input bytes, a range of unknown size is priced by its
+   pixels alone with the whole calibrated decode cost */
+static double get_decode_time(const struct estimator_calibration* calibration,
+			      const struct estimator_source* source, double mpixels) {
+  if (source->input_bytes < 0) {
+    double pixel_share = calibration->decode_us_per_mbyte > 0 ? 1 - ESTIMATOR_BITSTREAM_SHARE : 1;
+    return calibration->decode_us_per_mpixel * mpixels / pixel_share / 1e6;
+  }
+  return (calibration->decode_us_per_mpixel * mpixels +
+	  calibration->decode_us_per_mbyte * source->input_bytes / 1e6) / 1e6;
+}
+
+/* The encode cost was measured with one preset, others are scaled along the x264 preset ladder */
+static double get_preset_cost(const struct estimator_calibration* calibration, const char* preset) {
+  double cost = pacer_get_relative_cost(preset, calibration->preset);
+  if (cost <= 0) {
+    throw_warning("Preset is not a standard x264 one, encode cost is not scaled for it.");
+    return 1;
+  }
+  return cost;
+}
+
+void estimator_run(const char* input_filename, float start_ts, float end_ts,
+		   const char* calibration_filename, const struct encoder_options* encoder_options) {
+  struct estimator_source source;
+  struct estimator_calibration calibration = default_calibration;
+  int calibrated = 0;
+  float duration = end_ts - start_ts;
+  const char* preset = encoder_options ? encoder_options->preset : ENCODER_VIDEO_DEFAULT_PRESET;
+
+  if (duration < 0) {
+    throw_error("Estimate range end is before its start.", -1);
+  }
+
+  if (calibration_filename) {
+    calibrated = read_calibration(calibration_filename, &calibration);
+    if (!calibrated) {
+      calibration = default_calibration;
+      throw_warning("Calibration file could not be read, using built-in coefficients.");
+    }
+  }
+
+  probe_source(input_filename, start_ts, end_ts, encoder_options, &source);
+  if (source.video.frame_rate <= 0) {
+    throw_error("Source frame rate is unknown, the frame count cannot be estimated.", -1);
+  }
+
+  // Copied audio packets are only muxed, which the per frame cost already covers
+  double audio_seconds = source.audio_copied ? 0 : duration;
+  double frames = get_video_frames(&source, duration);
+  double mpixels = get_video_mpixels(&source, frames);
+  double decode_time = get_decode_time(&calibration, &source, mpixels);
+  double scale_time = (calibration.scale_us_per_mpixel * mpixels +
+		       calibration.resample_us_per_second * audio_seconds) / 1e6;
+  double encode_time = (calibration.encode_us_per_frame * get_preset_cost(&calibration, preset) *
+			frames + calibration.audio_encode_us_per_second * audio_seconds) / 1e6;
+  double output_bytes = calibration.output_bytes_per_second * duration;
+  double peak_memory = calibration.base_memory_bytes + get_buffered_bytes(&calibration);
+
+  printf("{\n  \"input\": ");
+  print_json_string(input_filename);
+  printf(",\n  \"start\": %.3f,\n  \"end\": %.3f,\n  \"duration\": %.3f,\n", start_ts, end_ts,
+	 duration);
+  printf("  \"video\": { \"codec\": ");
+  print_json_string(source.video.codec_name);
+  printf(", \"width\": %d, \"height\": %d, \"frame_rate\": %.3f, \"frames\": %.0f },\n",
+	 source.video.width, source.video.height, source.video.frame_rate, frames);
+  printf("  \"audio\": { \"codec\": ");
+  print_json_string(source.audio.codec_name);
+  printf(", \"sample_rate\": %d, \"channels\": %d, \"copied\": %s },\n",
+	 source.audio.sample_rate, source.audio.channels, source.audio_copied ? "true" : "false");
+  printf("  \"input_bytes\": %lld,\n  \"input_bytes_source\": \"%s\",\n",
+	 (long long)source.input_bytes, source.input_bytes_source);
+  printf("  \"input_bit_rate\": %lld,\n", duration > 0 && source.input_bytes > 0 ?
+	 (long long)(source.input_bytes * 8 / duration) : -1LL);
+  printf("  \"calibrated\": %s,\n", calibrated ? "true" : "false");
+  printf("  \"preset\": ");
+  print_json_string(preset);
+  printf(",\n  \"calibration_preset\": ");
+  print_json_string(calibration.preset);
+  printf(",\n");
+  printf("  \"estimate\": {\n");
+  printf("    \"decode_cpu_seconds\": %.3f,\n", decode_time);
+  printf("    \"scale_cpu_seconds\": %.3f,\n", scale_time);
+  printf("    \"encode_cpu_seconds\": %.3f,\n", encode_time);
+  printf("    \"total_cpu_seconds\": %.3f,\n", decode_time + scale_time + encode_time);
+  printf("    \"output_bytes\": %.0f,\n", output_bytes);
+  printf("    \"peak_memory_bytes\": %.0f\n", peak_memory);
+  printf("  }\n}\n");
+}
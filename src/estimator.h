@@ -0,0 +1,23 @@
+#ifndef _ESTIMATOR_H_
+#define _ESTIMATOR_H_
+
+#include "encoder.h"
+
+/*
+ * Transcodes the range once while measuring every stage and stores the resulting cost
+ * coefficients in calibration_filename, to be used by later estimates on this machine.
+ */
+extern void estimator_calibrate(const char* input_filename, float start_ts, float end_ts,
+				const char* output_filename, const char* calibration_filename,
+				const struct encoder_options* encoder_options);
+
+/*
+ * Prints a JSON prediction of the CPU time, output size and peak memory of cutting the range,
+ * reading only the container headers and index. Built-in coefficients are used when
+ * calibration_filename is NULL. encoder_options (may be NULL) decide whether audio is copied.
+ */
+extern void estimator_run(const char* input_filename, float start_ts, float end_ts,
+			  const char* calibration_filename,
+			  const struct encoder_options* encoder_options);
+
+#endif
@@ -0,0 +1,278 @@
+#include "fastscale.h"
+#include "common/cpu.h"
+#include "common/error.h"
+
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Every kernel is built from a rounding average of two bytes, (a + b + 1) >> 1, which is
+ * exactly what pavgb computes. A 2:1 box is the average of two averaged rows followed by
+ * the average of neighbouring columns, a 4:1 box repeats each step twice. The scalar and
+ * SIMD paths therefore produce bit-identical pictures.
+ */
+
+struct fastscale_kernels {
+  const char* name;
+  void (*average_rows)(uint8_t* dst, const uint8_t* row0, const uint8_t* row1, int width);
+  void (*halve_row)(uint8_t* dst, const uint8_t* src, int dst_width);
+  void (*halve_row_interleaved)(uint8_t* dst, const uint8_t* src, int dst_pairs);
+};
+
+typedef struct fastscale_context {
+  const struct fastscale_kernels* kernels;
+  uint8_t* scratch; // two source rows, grown with the widest source seen
+  size_t scratch_size;
+} fastscale_context_t;
+
+static inline uint8_t average_bytes(uint8_t a, uint8_t b) {
+  return (uint8_t)((a + b + 1) >> 1);
+}
+
+static void average_rows_c(uint8_t* dst, const uint8_t* row0, const uint8_t* row1, int width) {
+  for (int i = 0; i < width; i++) {
+    dst[i] = average_bytes(row0[i], row1[i]);
+  }
+}
+
+static void halve_row_c(uint8_t* dst, const uint8_t* src, int dst_width) {
+  for (int i = 0; i < dst_width; i++) {
+    dst[i] = average_bytes(src[2 * i], src[2 * i + 1]);
+  }
+}
+
+static void halve_row_interleaved_c(uint8_t* dst, const uint8_t* src, int dst_pairs) {
+  for (int i = 0; i < dst_pairs; i++) {
+    dst[2 * i] = average_bytes(src[4 * i], src[4 * i + 2]);
+    dst[2 * i + 1] = average_bytes(src[4 * i + 1], src[4 * i + 3]);
+  }
+}
+
+static const struct fastscale_kernels kernels_c = {
+  "c", average_rows_c, halve_row_c, halve_row_interleaved_c
+};
+
+#ifdef CPU_X86
+
+__attribute__((target("sse2")))
+static void average_rows_sse2(uint8_t* dst, const uint8_t* row0, const uint8_t* row1, int width) {
+  int i = 0;
+  for (; i + 16 <= width; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(row0 + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(row1 + i));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_avg_epu8(a, b));
+  }
+  average_rows_c(dst + i, row0 + i, row1 + i, width - i);
+}
+
+__attribute__((target("sse2")))
+static void halve_row_sse2(uint8_t* dst, const uint8_t* src, int dst_width) {
+  const __m128i mask = _mm_set1_epi16(0x00ff);
+  int i = 0;
+  for (; i + 16 <= dst_width; i += 16) {
+    __m128i x0 = _mm_loadu_si128((const __m128i*)(src + 2 * i));
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(src + 2 * i + 16));
+    // Even bytes end up holding the average with their right neighbour
+    x0 = _mm_and_si128(_mm_avg_epu8(x0, _mm_srli_si128(x0, 1)), mask);
+    x1 = _mm_and_si128(_mm_avg_epu8(x1, _mm_srli_si128(x1, 1)), mask);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(x0, x1));
+  }
+  halve_row_c(dst + i, src + 2 * i, dst_width - i);
+}
+
+__attribute__((target("sse2")))
+static void halve_row_interleaved_sse2(uint8_t* dst, const uint8_t* src, int dst_pairs) {
+  int i = 0;
+  for (; i + 8 <= dst_pairs; i += 8) {
+    __m128i x0 = _mm_loadu_si128((const __m128i*)(src + 4 * i));
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(src + 4 * i + 16));
+    // Low halves of the 32-bit lanes hold the averaged UV pair, sign-extend them for packs
+    x0 = _mm_avg_epu8(x0, _mm_srli_si128(x0, 2));
+    x1 = _mm_avg_epu8(x1, _mm_srli_si128(x1, 2));
+    x0 = _mm_srai_epi32(_mm_slli_epi32(x0, 16), 16);
+    x1 = _mm_srai_epi32(_mm_slli_epi32(x1, 16), 16);
+    _mm_storeu_si128((__m128i*)(dst + 2 * i), _mm_packs_epi32(x0, x1));
+  }
+  halve_row_interleaved_c(dst + 2 * i, src + 4 * i, dst_pairs - i);
+}
+
+static const struct fastscale_kernels kernels_sse2 = {
+  "sse2", average_rows_sse2, halve_row_sse2, halve_row_interleaved_sse2
+};
+
+__attribute__((target("avx2")))
+static void average_rows_avx2(uint8_t* dst, const uint8_t* row0, const uint8_t* row1, int width) {
+  int i = 0;
+  for (; i + 32 <= width; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(row0 + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(row1 + i));
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_avg_epu8(a, b));
+  }
+  average_rows_sse2(dst + i, row0 + i, row1 + i, width - i);
+}
+
+__attribute__((target("avx2")))
+static void halve_row_avx2(uint8_t* dst, const uint8_t* src, int dst_width) {
+  const __m256i mask = _mm256_set1_epi16(0x00ff);
+  int i = 0;
+  for (; i + 32 <= dst_width; i += 32) {
+    __m256i x0 = _mm256_loadu_si256((const __m256i*)(src + 2 * i));
+    __m256i x1 = _mm256_loadu_si256((const __m256i*)(src + 2 * i + 32));
+    x0 = _mm256_and_si256(_mm256_avg_epu8(x0, _mm256_srli_si256(x0, 1)), mask);
+    x1 = _mm256_and_si256(_mm256_avg_epu8(x1, _mm256_srli_si256(x1, 1)), mask);
+    // packus works per 128-bit lane, restore the quadword order afterwards
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(x0, x1), 0xd8);
+    _mm256_storeu_si256((__m256i*)(dst + i), packed);
+  }
+  halve_row_sse2(dst + i, src + 2 * i, dst_width - i);
+}
+
+__attribute__((target("avx2")))
+static void halve_row_interleaved_avx2(uint8_t* dst, const uint8_t* src, int dst_pairs) {
+  int i = 0;
+  for (; i + 16 <= dst_pairs; i += 16) {
+    __m256i x0 = _mm256_loadu_si256((const __m256i*)(src + 4 * i));
+    __m256i x1 = _mm256_loadu_si256((const __m256i*)(src + 4 * i + 32));
+    x0 = _mm256_avg_epu8(x0, _mm256_srli_si256(x0, 2));
+    x1 = _mm256_avg_epu8(x1, _mm256_srli_si256(x1, 2));
+    x0 = _mm256_srai_epi32(_mm256_slli_epi32(x0, 16), 16);
+    x1 = _mm256_srai_epi32(_mm256_slli_epi32(x1, 16), 16);
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(x0, x1), 0xd8);
+    _mm256_storeu_si256((__m256i*)(dst + 2 * i), packed);
+  }
+  halve_row_interleaved_sse2(dst + 2 * i, src + 4 * i, dst_pairs - i);
+}
+
+static const struct fastscale_kernels kernels_avx2 = {
+  "avx2", average_rows_avx2, halve_row_avx2, halve_row_interleaved_avx2
+};
+
+#endif
+
+static const struct fastscale_kernels* get_kernels() {
+#ifdef CPU_X86
+  switch (cpu_get_level()) {
+  case CPU_LEVEL_AVX2:
+    return &kernels_avx2;
+  case CPU_LEVEL_SSE2:
+    return &kernels_sse2;
+  default:
+    break;
+  }
+#endif
+  return &kernels_c;
+}
+
+static void downscale_plane(const struct fastscale_kernels* kernels, uint8_t* dst, int dst_linesize,
+			    const uint8_t* src, int src_linesize, int dst_width, int dst_height,
+			    int ratio, int interleaved, uint8_t* scratch) {
+  int bytes_per_element = interleaved ? 2 : 1;
+  int src_bytes = dst_width * ratio * bytes_per_element;
+  uint8_t* rows = scratch;
+  uint8_t* half = scratch + src_bytes;
+
+  void (*halve)(uint8_t*, const uint8_t*, int) =
+    interleaved ? kernels->halve_row_interleaved : kernels->halve_row;
+
+  for (int y = 0; y < dst_height; y++) {
+    const uint8_t* row = src + (ptrdiff_t)y * ratio * src_linesize;
+    uint8_t* dst_row = dst + (ptrdiff_t)y * dst_linesize;
+
+    if (ratio == 2) {
+      kernels->average_rows(rows, row, row + src_linesize, src_bytes);
+      halve(dst_row, rows, dst_width);
+    } else {
+      kernels->average_rows(rows, row, row + src_linesize, src_bytes);
+      kernels->average_rows(half, row + 2 * src_linesize, row + 3 * src_linesize, src_bytes);
+      kernels->average_rows(rows, rows, half, src_bytes);
+      halve(half, rows, dst_width * 2);
+      halve(dst_row, half, dst_width);
+    }
+  }
+}
+
+int fastscale_get_ratio(int src_width, int src_height, int src_format, int dst_width,
+			int dst_height, int dst_format) {
+  if (src_format != dst_format) {
+    return 0;
+  }
+  if (src_format != AV_PIX_FMT_YUV420P && src_format != AV_PIX_FMT_NV12) {
+    return 0;
+  }
+  // Odd destination sizes would leave a partial chroma sample at the edge
+  if (dst_width <= 0 || dst_height <= 0 || (dst_width & 1) || (dst_height & 1)) {
+    return 0;
+  }
+
+  for (int ratio = 2; ratio <= 4; ratio *= 2) {
+    if (src_width == dst_width * ratio && src_height == dst_height * ratio) {
+      return ratio;
+    }
+  }
+  return 0;
+}
+
+void fastscale_open(fastscale_context_t** fastscale_context) {
+  fastscale_context_t* context = (fastscale_context_t*)malloc(sizeof(fastscale_context_t));
+  if (!context) {
+    throw_error("Fast scaler context allocation failed.", -1);
+  }
+
+  context->kernels = get_kernels();
+  context->scratch = NULL;
+  context->scratch_size = 0;
+
+  *fastscale_context = context;
+}
+
+void fastscale_close(fastscale_context_t** fastscale_context) {
+  free((*fastscale_context)->scratch);
+  free(*fastscale_context);
+  *fastscale_context = NULL;
+}
+
+void fastscale_frame(fastscale_context_t* fastscale_context, const void* src_frame,
+		     void* dst_frame, int ratio) {
+  const AVFrame* src = (const AVFrame*)src_frame;
+  AVFrame* dst = (AVFrame*)dst_frame;
+  const struct fastscale_kernels* kernels = fastscale_context->kernels;
+
+  int chroma_width = dst->width / 2;
+  int chroma_height = dst->height / 2;
+  size_t scratch_size = 2 * (size_t)src->width;
+
+  // Sources of a concatenation may differ in width, the buffer only ever grows
+  if (scratch_size > fastscale_context->scratch_size) {
+    uint8_t* scratch = (uint8_t*)realloc(fastscale_context->scratch, scratch_size);
+    if (!scratch) {
+      throw_error("Fast scaler scratch allocation failed.", -1);
+    }
+    fastscale_context->scratch = scratch;
+    fastscale_context->scratch_size = scratch_size;
+  }
+  uint8_t* scratch = fastscale_context->scratch;
+
+  downscale_plane(kernels, dst->data[0], dst->linesize[0], src->data[0], src->linesize[0],
+		  dst->width, dst->height, ratio, 0, scratch);
+
+  if (src->format == AV_PIX_FMT_NV12) {
+    downscale_plane(kernels, dst->data[1], dst->linesize[1], src->data[1], src->linesize[1],
+		    chroma_width, chroma_height, ratio, 1, scratch);
+  } else {
+    for (int plane = 1; plane < 3; plane++) {
+      downscale_plane(kernels, dst->data[plane], dst->linesize[plane], src->data[plane],
+		      src->linesize[plane], chroma_width, chroma_height, ratio, 0, scratch);
+    }
+  }
+}
+
+const char* fastscale_get_kernel_name() {
+  return get_kernels()->name;
+}
@@ -0,0 +1,21 @@
+#ifndef _FASTSCALE_H_
+#define _FASTSCALE_H_
+
+typedef struct fastscale_context fastscale_context_t;
+
+/* Returns 2 or 4 when the conversion is an exact integer-ratio downscale of a YUV420P or NV12
+   picture into the same format, and 0 when it has to go through swscale. */
+extern int fastscale_get_ratio(int src_width, int src_height, int src_format, int dst_width,
+			       int dst_height, int dst_format);
+
+/* The context keeps the row buffer between frames, one per thread. */
+extern void fastscale_open(fastscale_context_t** fastscale_context);
+extern void fastscale_close(fastscale_context_t** fastscale_context);
+
+/* Box-downscales src_frame into the already allocated dst_frame (both AVFrame*). */
+extern void fastscale_frame(fastscale_context_t* fastscale_context, const void* src_frame,
+			    void* dst_frame, int ratio);
+
+extern const char* fastscale_get_kernel_name();
+
+#endif
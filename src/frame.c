@@ -20,7 +20,11 @@ frame_t* frame_alloc(enum frame_type type) {
   frame->last = NULL;
   frame->type = type;
 
-  frame->item.buffer = av_frame_alloc();
+  if (type == FRAME_PACKET_TYPE) {
+    frame->item.buffer = av_packet_alloc();
+  } else {
+    frame->item.buffer = av_frame_alloc();
+  }
   frame->item.stream_id = 0;
 
   if (!frame->item.buffer) {
@@ -79,12 +83,38 @@ void frame_free(frame_t** frame) {
   }
 
   if (*frame != NULL) {
-    av_frame_free((AVFrame**)&((*frame)->item.buffer));
+    if ((*frame)->type == FRAME_PACKET_TYPE) {
+      av_packet_free((AVPacket**)&((*frame)->item.buffer));
+    } else {
+      av_frame_free((AVFrame**)&((*frame)->item.buffer));
+    }
     free(*frame);
     frame = NULL;
   }
 }
 
+frame_t* frame_detach(frame_t* frame) {
+  frame_t* next = frame->next;
+  if (!next) {
+    return NULL;
+  }
+
+  next->prev = NULL;
+  frame->next = NULL;
+  frame->last = NULL;
+
+  // A single frame is its own last, nothing frees the shared pointer otherwise
+  if (!next->next) {
+    free(next->last);
+    next->last = NULL;
+  }
+  return next;
+}
+
 struct frame_item* frame_get_item(frame_t* frame) {
   return &frame->item;
 }
+
+enum frame_type frame_get_type(frame_t* frame) {
+  return frame->type;
+}
@@ -3,7 +3,8 @@
 
 typedef struct _frame frame_t;
 
-enum frame_type { FRAME_VIDEO_TYPE, FRAME_AUDIO_TYPE };
+// Packet items hold a compressed AVPacket instead of an AVFrame
+enum frame_type { FRAME_VIDEO_TYPE, FRAME_AUDIO_TYPE, FRAME_PACKET_TYPE };
 
 struct frame_item {
   void* buffer;
@@ -16,7 +17,10 @@ extern frame_t* frame_last(frame_t* frame);
 
 extern int frame_attach_to(frame_t* parent, frame_t* child);
 extern void frame_free(frame_t** frame);
+/* Unlinks the head of a list and returns the rest of it, NULL when it was alone. */
+extern frame_t* frame_detach(frame_t* frame);
 
 struct frame_item* frame_get_item(frame_t* frame);
+enum frame_type frame_get_type(frame_t* frame);
 
 #endif
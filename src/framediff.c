@@ -0,0 +1,122 @@
+#include "framediff.h"
+#include "common/cpu.h"
+
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+struct framediff_kernels {
+  const char* name;
+  uint64_t (*sad_row)(const uint8_t* row0, const uint8_t* row1, int width);
+};
+
+static uint64_t sad_row_c(const uint8_t* row0, const uint8_t* row1, int width) {
+  uint64_t sad = 0;
+  for (int i = 0; i < width; i++) {
+    sad += (uint64_t)abs(row0[i] - row1[i]);
+  }
+  return sad;
+}
+
+static const struct framediff_kernels kernels_c = { "c", sad_row_c };
+
+#ifdef CPU_X86
+
+__attribute__((target("sse2")))
+static uint64_t sad_row_sse2(const uint8_t* row0, const uint8_t* row1, int width) {
+  __m128i sum = _mm_setzero_si128();
+  int i = 0;
+
+  for (; i + 16 <= width; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(row0 + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(row1 + i));
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(a, b));
+  }
+
+  uint64_t sad = (uint64_t)_mm_cvtsi128_si64(sum) +
+    (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(sum, sum));
+  return sad + sad_row_c(row0 + i, row1 + i, width - i);
+}
+
+static const struct framediff_kernels kernels_sse2 = { "sse2", sad_row_sse2 };
+
+__attribute__((target("avx2")))
+static uint64_t sad_row_avx2(const uint8_t* row0, const uint8_t* row1, int width) {
+  __m256i sum = _mm256_setzero_si256();
+  int i = 0;
+
+  for (; i + 32 <= width; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(row0 + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(row1 + i));
+    sum = _mm256_add_epi64(sum, _mm256_sad_epu8(a, b));
+  }
+
+  __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+  uint64_t sad = (uint64_t)_mm_cvtsi128_si64(half) +
+    (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(half, half));
+  return sad + sad_row_c(row0 + i, row1 + i, width - i);
+}
+
+static const struct framediff_kernels kernels_avx2 = { "avx2", sad_row_avx2 };
+
+#endif
+
+static const struct framediff_kernels* get_kernels() {
+#ifdef CPU_X86
+  switch (cpu_get_level()) {
+  case CPU_LEVEL_AVX2:
+    return &kernels_avx2;
+  case CPU_LEVEL_SSE2:
+    return &kernels_sse2;
+  default:
+    break;
+  }
+#endif
+  return &kernels_c;
+}
+
+int framediff_is_duplicate(const void* frame_a, const void* frame_b, float threshold) {
+  const AVFrame* a = (const AVFrame*)frame_a;
+  const AVFrame* b = (const AVFrame*)frame_b;
+  const struct framediff_kernels* kernels = get_kernels();
+
+  if (a->format != b->format || a->width != b->width || a->height != b->height || a->format < 0) {
+    return 0;
+  }
+
+  const AVPixFmtDescriptor* descriptor = av_pix_fmt_desc_get(a->format);
+  if (!descriptor || descriptor->comp[0].depth > 8 || (descriptor->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+    return 0;
+  }
+
+  int nb_planes = av_pix_fmt_count_planes(a->format);
+  for (int plane = 0; plane < nb_planes; plane++) {
+    int bytes = av_image_get_linesize(a->format, a->width, plane);
+    int height = a->height;
+    if (plane == 1 || plane == 2) {
+      height = AV_CEIL_RSHIFT(height, descriptor->log2_chroma_h);
+    }
+
+    // Rows are checked top to bottom, changed content usually fails within a few of them
+    uint64_t limit = (uint64_t)(threshold * bytes);
+    for (int y = 0; y < height; y++) {
+      const uint8_t* row0 = a->data[plane] + (ptrdiff_t)y * a->linesize[plane];
+      const uint8_t* row1 = b->data[plane] + (ptrdiff_t)y * b->linesize[plane];
+      if (kernels->sad_row(row0, row1, bytes) > limit) {
+	return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+const char* framediff_get_kernel_name() {
+  return get_kernels()->name;
+}
@@ -0,0 +1,11 @@
+#ifndef _FRAMEDIFF_H_
+#define _FRAMEDIFF_H_
+
+/* Whether two pictures (AVFrame*) of the same 8-bit format and size differ by at most threshold
+   per byte on average in every row of every plane. A row limit rather than a picture one keeps
+   small changes such as a moving cursor from being averaged away. */
+extern int framediff_is_duplicate(const void* frame_a, const void* frame_b, float threshold);
+
+extern const char* framediff_get_kernel_name();
+
+#endif
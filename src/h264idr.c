@@ -0,0 +1,481 @@
+#include "h264idr.h"
+#include "common/error.h"
+
+#include <libavcodec/avcodec.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define H264IDR_NAL_IDR_SLICE 5
+#define H264IDR_NAL_SPS 7
+#define H264IDR_NAL_PPS 8
+#define H264IDR_MAX_SPS 32
+#define H264IDR_MAX_PPS 256
+
+/* The few fields a slice header up to its end depends on */
+struct h264idr_sps {
+  int valid;
+  int separate_colour_plane;
+  int log2_max_frame_num;
+  int poc_type;
+  int log2_max_poc_lsb;
+  int delta_pic_order_always_zero;
+  int frame_mbs_only;
+};
+
+struct h264idr_pps {
+  int valid;
+  int sps_id;
+  int cabac;
+  int bottom_field_pic_order_present;
+  int deblocking_filter_control_present;
+  int redundant_pic_cnt_present;
+};
+
+typedef struct h264idr_context {
+  struct h264idr_sps sps[H264IDR_MAX_SPS];
+  struct h264idr_pps pps[H264IDR_MAX_PPS];
+  int next_idr_pic_id;
+} h264idr_context_t;
+
+struct bit_reader {
+  const uint8_t* data;
+  int64_t size; // in bits
+  int64_t pos;
+  int error;
+};
+
+struct bit_writer {
+  uint8_t* data;
+  int64_t pos;
+};
+
+static unsigned read_bits(struct bit_reader* reader, int count) {
+  unsigned value = 0;
+
+  if (reader->pos + count > reader->size) {
+    reader->error = 1;
+    return 0;
+  }
+  for (int i = 0; i < count; i++, reader->pos++) {
+    value = (value << 1) | ((reader->data[reader->pos >> 3] >> (7 - (reader->pos & 7))) & 1);
+  }
+  return value;
+}
+
+static unsigned read_ue(struct bit_reader* reader) {
+  int zeros = 0;
+
+  while (!read_bits(reader, 1)) {
+    if (reader->error || ++zeros > 31) {
+      reader->error = 1;
+      return 0;
+    }
+  }
+  return (1u << zeros) - 1 + read_bits(reader, zeros);
+}
+
+static int read_se(struct bit_reader* reader) {
+  unsigned value = read_ue(reader);
+  return value & 1 ? (int)((value + 1) / 2) : -(int)(value / 2);
+}
+
+static void write_bits(struct bit_writer* writer, unsigned value, int count) {
+  for (int i = count - 1; i >= 0; i--, writer->pos++) {
+    uint8_t* byte = &writer->data[writer->pos >> 3];
+    int shift = 7 - (writer->pos & 7);
+    *byte = (uint8_t)((*byte & ~(1 << shift)) | (((value >> i) & 1) << shift));
+  }
+}
+
+static void write_ue(struct bit_writer* writer, unsigned value) {
+  int length = 0;
+  while ((value + 1) >> (length + 1)) {
+    length++;
+  }
+  write_bits(writer, 0, length);
+  write_bits(writer, value + 1, length + 1);
+}
+
+static void copy_bits(struct bit_writer* writer, struct bit_reader* reader, int64_t end) {
+  while (reader->pos < end) {
+    int count = end - reader->pos > 24 ? 24 : (int)(end - reader->pos);
+    write_bits(writer, read_bits(reader, count), count);
+  }
+}
+
+/* Emulation prevention bytes only exist in the escaped NAL, fields are read from the payload */
+static int unescape_nal(const uint8_t* nal, int size, uint8_t* rbsp) {
+  int length = 0;
+  for (int i = 0; i < size; i++) {
+    if (i >= 2 && nal[i] == 3 && nal[i - 1] == 0 && nal[i - 2] == 0) {
+      continue;
+    }
+    rbsp[length++] = nal[i];
+  }
+  return length;
+}
+
+static int escape_nal(const uint8_t* rbsp, int size, uint8_t* nal) {
+  int length = 0;
+  int zeros = 0;
+  for (int i = 0; i < size; i++) {
+    if (zeros >= 2 && rbsp[i] <= 3) {
+      nal[length++] = 3;
+      zeros = 0;
+    }
+    nal[length++] = rbsp[i];
+    zeros = rbsp[i] ? 0 : zeros + 1;
+  }
+  if (zeros >= 2) {
+    nal[length++] = 3;
+  }
+  return length;
+}
+
+static void skip_scaling_list(struct bit_reader* reader, int size) {
+  int last_scale = 8;
+  int next_scale = 8;
+  for (int i = 0; i < size && next_scale && !reader->error; i++) {
+    next_scale = (last_scale + read_se(reader) + 256) % 256;
+    last_scale = next_scale ? next_scale : last_scale;
+  }
+}
+
+static void parse_sps(h264idr_context_t* context, struct bit_reader* reader) {
+  struct h264idr_sps sps;
+  memset(&sps, 0, sizeof(sps));
+
+  int profile_idc = read_bits(reader, 8);
+  read_bits(reader, 16); // constraint flags and level
+  unsigned sps_id = read_ue(reader);
+
+  if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 || profile_idc == 244 ||
+      profile_idc == 44 || profile_idc == 83 || profile_idc == 86 || profile_idc == 118 ||
+      profile_idc == 128 || profile_idc == 138 || profile_idc == 139 || profile_idc == 134 ||
+      profile_idc == 135) {
+    unsigned chroma_format_idc = read_ue(reader);
+    if (chroma_format_idc == 3) {
+      sps.separate_colour_plane = read_bits(reader, 1);
+    }
+    read_ue(reader); // bit depths
+    read_ue(reader);
+    read_bits(reader, 1);
+    if (read_bits(reader, 1)) {
+      for (int i = 0; i < (chroma_format_idc == 3 ? 12 : 8); i++) {
+	if (read_bits(reader, 1)) {
+	  skip_scaling_list(reader, i < 6 ? 16 : 64);
+	}
+      }
+    }
+  }
+
+  sps.log2_max_frame_num = read_ue(reader) + 4;
+  sps.poc_type = read_ue(reader);
+  if (sps.poc_type == 0) {
+    sps.log2_max_poc_lsb = read_ue(reader) + 4;
+  } else if (sps.poc_type == 1) {
+    sps.delta_pic_order_always_zero = read_bits(reader, 1);
+    read_se(reader);
+    read_se(reader);
+    unsigned cycle = read_ue(reader);
+    for (unsigned i = 0; i < cycle && !reader->error; i++) {
+      read_se(reader);
+    }
+  }
+  read_ue(reader); // max_num_ref_frames
+  read_bits(reader, 1);
+  read_ue(reader); // picture size in macroblocks
+  read_ue(reader);
+  sps.frame_mbs_only = read_bits(reader, 1);
+
+  if (!reader->error && sps_id < H264IDR_MAX_SPS) {
+    sps.valid = 1;
+    context->sps[sps_id] = sps;
+  }
+}
+
+static void parse_pps(h264idr_context_t* context, struct bit_reader* reader) {
+  struct h264idr_pps pps;
+  memset(&pps, 0, sizeof(pps));
+
+  unsigned pps_id = read_ue(reader);
+  pps.sps_id = read_ue(reader);
+  pps.cabac = read_bits(reader, 1);
+  pps.bottom_field_pic_order_present = read_bits(reader, 1);
+  unsigned nb_slice_groups = read_ue(reader) + 1;
+  read_ue(reader); // num_ref_idx defaults
+  read_ue(reader);
+  read_bits(reader, 3); // weighted prediction
+  read_se(reader);      // initial qp and qs
+  read_se(reader);
+  read_se(reader);
+  pps.deblocking_filter_control_present = read_bits(reader, 1);
+  read_bits(reader, 1);
+  pps.redundant_pic_cnt_present = read_bits(reader, 1);
+
+  // Slice groups would add fields at the end of the slice header, nothing here produces them
+  if (!reader->error && pps_id < H264IDR_MAX_PPS && pps.sps_id < H264IDR_MAX_SPS &&
+      nb_slice_groups == 1) {
+    pps.valid = 1;
+    context->pps[pps_id] = pps;
+  }
+}
+
+/* Rebuilds one IDR slice payload (header byte included) with another idr_pic_id, returns its new
+   size, 0 when the id already matches, or -1 when the header could not be followed */
+static int rewrite_idr_slice(h264idr_context_t* context, const uint8_t* rbsp, int size,
+			     unsigned idr_pic_id, uint8_t* output) {
+  struct bit_reader reader = { rbsp, (int64_t)size * 8, 8, 0 };
+
+  read_ue(&reader); // first_mb_in_slice
+  unsigned slice_type = read_ue(&reader) % 5;
+  unsigned pps_id = read_ue(&reader);
+  if (reader.error || pps_id >= H264IDR_MAX_PPS || !context->pps[pps_id].valid ||
+      !context->sps[context->pps[pps_id].sps_id].valid || (slice_type != 2 && slice_type != 4)) {
+    return -1;
+  }
+  const struct h264idr_pps* pps = &context->pps[pps_id];
+  const struct h264idr_sps* sps = &context->sps[pps->sps_id];
+
+  int field_pic = 0;
+  if (sps->separate_colour_plane) {
+    read_bits(&reader, 2);
+  }
+  read_bits(&reader, sps->log2_max_frame_num);
+  if (!sps->frame_mbs_only && (field_pic = read_bits(&reader, 1))) {
+    read_bits(&reader, 1);
+  }
+
+  int64_t id_start = reader.pos;
+  unsigned old_idr_pic_id = read_ue(&reader);
+  int64_t id_end = reader.pos;
+
+  if (sps->poc_type == 0) {
+    read_bits(&reader, sps->log2_max_poc_lsb);
+    if (pps->bottom_field_pic_order_present && !field_pic) {
+      read_se(&reader);
+    }
+  } else if (sps->poc_type == 1 && !sps->delta_pic_order_always_zero) {
+    read_se(&reader);
+    if (pps->bottom_field_pic_order_present && !field_pic) {
+      read_se(&reader);
+    }
+  }
+  if (pps->redundant_pic_cnt_present) {
+    read_ue(&reader);
+  }
+  read_bits(&reader, 2); // dec_ref_pic_marking of an IDR picture
+  read_se(&reader);      // slice_qp_delta
+  if (slice_type == 4) {
+    read_se(&reader);    // slice_qs_delta
+  }
+  if (pps->deblocking_filter_control_present && read_ue(&reader) != 1) {
+    read_se(&reader);
+    read_se(&reader);
+  }
+  int64_t header_end = reader.pos;
+
+  if (reader.error) {
+    return -1;
+  }
+  if (old_idr_pic_id == idr_pic_id) {
+    return 0;
+  }
+
+  struct bit_writer writer = { output, 0 };
+  memset(output, 0, size + 8);
+  reader.pos = 0;
+  copy_bits(&writer, &reader, id_start);
+  write_ue(&writer, idr_pic_id);
+  reader.pos = id_end;
+  copy_bits(&writer, &reader, header_end);
+
+  if (pps->cabac) {
+    // CABAC slice data starts byte aligned after one bits, it moves as a whole
+    int64_t data_start = (header_end + 7) & ~(int64_t)7;
+    while (writer.pos & 7) {
+      write_bits(&writer, 1, 1);
+    }
+    memcpy(output + (writer.pos >> 3), rbsp + (data_start >> 3), size - (data_start >> 3));
+    return (int)(writer.pos >> 3) + size - (int)(data_start >> 3);
+  }
+
+  // CAVLC slice data is shifted bit by bit up to the stop bit, the trailing bits are redone
+  int last = size - 1;
+  while (last > 0 && !rbsp[last]) {
+    last--;
+  }
+  int64_t stop_bit = (int64_t)last * 8 + 7;
+  while (!((rbsp[last] >> (7 - (stop_bit & 7))) & 1)) {
+    stop_bit--;
+  }
+  if (stop_bit < header_end) {
+    return -1;
+  }
+  copy_bits(&writer, &reader, stop_bit);
+  write_bits(&writer, 1, 1);
+  while (writer.pos & 7) {
+    write_bits(&writer, 0, 1);
+  }
+  return (int)(writer.pos >> 3);
+}
+
+static const uint8_t* find_start_code(const uint8_t* data, const uint8_t* end) {
+  for (; data + 3 <= end; data++) {
+    if (!data[0] && !data[1] && data[2] == 1) {
+      return data;
+    }
+  }
+  return end;
+}
+
+static void parse_parameter_set(h264idr_context_t* context, const uint8_t* nal, int size) {
+  int type = nal[0] & 0x1f;
+  if (type != H264IDR_NAL_SPS && type != H264IDR_NAL_PPS) {
+    return;
+  }
+
+  uint8_t* rbsp = (uint8_t*)malloc(size);
+  if (!rbsp) {
+    throw_error("H.264 parser allocation failed.", -1);
+  }
+  int length = unescape_nal(nal, size, rbsp);
+  struct bit_reader reader = { rbsp, (int64_t)length * 8, 8, 0 };
+
+  if (type == H264IDR_NAL_SPS) {
+    parse_sps(context, &reader);
+  } else {
+    parse_pps(context, &reader);
+  }
+  free(rbsp);
+}
+
+struct packet_rewrite {
+  const uint8_t* source;
+  uint8_t* output;
+  int64_t source_pos; // copied up to here
+  int64_t output_pos;
+  unsigned idr_pic_id;
+  int has_idr;
+  int failed;
+};
+
+static void rewrite_nal_unit(h264idr_context_t* context, const uint8_t* nal, int size,
+			     struct packet_rewrite* rewrite) {
+  int type = nal[0] & 0x1f;
+
+  if (type != H264IDR_NAL_IDR_SLICE || rewrite->failed) {
+    return;
+  }
+  rewrite->has_idr = 1;
+
+  uint8_t* rbsp = (uint8_t*)malloc(2 * size + 16);
+  if (!rbsp) {
+    throw_error("H.264 parser allocation failed.", -1);
+  }
+  uint8_t* slice = rbsp + size;
+  int length = unescape_nal(nal, size, rbsp);
+  int slice_size = rewrite_idr_slice(context, rbsp, length, rewrite->idr_pic_id, slice);
+
+  if (slice_size < 0) {
+    rewrite->failed = 1;
+  } else if (slice_size > 0) {
+    // Everything before the NAL as it was, then the NAL escaped again
+    int64_t offset = nal - rewrite->source;
+    memcpy(rewrite->output + rewrite->output_pos, rewrite->source + rewrite->source_pos,
+	   offset - rewrite->source_pos);
+    rewrite->output_pos += offset - rewrite->source_pos;
+    rewrite->output_pos += escape_nal(slice, slice_size, rewrite->output + rewrite->output_pos);
+    rewrite->source_pos = offset + size;
+  }
+  free(rbsp);
+}
+
+/* Goes through the NAL units of an Annex B buffer, trailing zero bytes left out, keeping the
+   parameter sets and rewriting the IDR slices when rewrite is not NULL. Parameter sets repeated
+   in band come before the slices that use them. */
+static void scan_nal_units(h264idr_context_t* context, const uint8_t* data, int size,
+			   struct packet_rewrite* rewrite) {
+  const uint8_t* end = data + size;
+  const uint8_t* nal = find_start_code(data, end);
+
+  while (nal < end) {
+    nal += 3;
+    const uint8_t* next = find_start_code(nal, end);
+    const uint8_t* nal_end = next;
+    while (nal_end > nal && !nal_end[-1]) {
+      nal_end--;
+    }
+    if (nal_end > nal) {
+      parse_parameter_set(context, nal, (int)(nal_end - nal));
+      if (rewrite) {
+	rewrite_nal_unit(context, nal, (int)(nal_end - nal), rewrite);
+      }
+    }
+    nal = next;
+  }
+}
+
+void h264idr_open(h264idr_context_t** h264idr_context, const void* extradata, int extradata_size) {
+  h264idr_context_t* context = (h264idr_context_t*)calloc(1, sizeof(h264idr_context_t));
+  if (!context) {
+    throw_error("H.264 parser allocation failed.", -1);
+  }
+
+  if (extradata && extradata_size > 0) {
+    scan_nal_units(context, (const uint8_t*)extradata, extradata_size, NULL);
+  }
+  *h264idr_context = context;
+}
+
+void h264idr_close(h264idr_context_t** h264idr_context) {
+  free(*h264idr_context);
+  *h264idr_context = NULL;
+}
+
+void h264idr_renumber_packet(h264idr_context_t* h264idr_context, void* avpacket) {
+  AVPacket* packet = (AVPacket*)avpacket;
+  struct packet_rewrite rewrite;
+
+  // A new id can take a byte more per slice, escaping at most half as much again
+  int capacity = packet->size * 3 / 2 + 64;
+  memset(&rewrite, 0, sizeof(rewrite));
+  rewrite.source = packet->data;
+  rewrite.idr_pic_id = h264idr_context->next_idr_pic_id;
+  rewrite.output = (uint8_t*)malloc(capacity);
+  if (!rewrite.output) {
+    throw_error("H.264 parser allocation failed.", -1);
+  }
+
+  scan_nal_units(h264idr_context, packet->data, packet->size, &rewrite);
+
+  // Left as encoded the id would repeat the one of the previous IDR picture
+  if (rewrite.failed) {
+    free(rewrite.output);
+    throw_error("Could not follow an IDR slice header to renumber it.", -1);
+  }
+  if (rewrite.has_idr) {
+    h264idr_context->next_idr_pic_id ^= 1;
+  }
+
+  if (!rewrite.failed && rewrite.source_pos > 0) {
+    int tail = packet->size - (int)rewrite.source_pos;
+    int size = (int)rewrite.output_pos + tail;
+
+    AVBufferRef* buffer = av_buffer_alloc(size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!buffer) {
+      throw_error("Packet allocation failed.", -1);
+    }
+    memcpy(buffer->data, rewrite.output, rewrite.output_pos);
+    memcpy(buffer->data + rewrite.output_pos, packet->data + rewrite.source_pos, tail);
+    memset(buffer->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+    av_buffer_unref(&packet->buf);
+    packet->buf = buffer;
+    packet->data = buffer->data;
+    packet->size = size;
+  }
+  free(rewrite.output);
+}
@@ -0,0 +1,20 @@
+#ifndef _H264IDR_H_
+#define _H264IDR_H_
+
+typedef struct h264idr_context h264idr_context_t;
+
+/*
+ * Renumbers idr_pic_id in Annex B H.264 packets so that consecutive IDR pictures alternate between
+ * 0 and 1, as 7.4.3 requires. Encoders running side by side each start their own sequence, their
+ * interleaved output would repeat ids. Parameter sets come from extradata (may be NULL) and from
+ * the packets themselves.
+ */
+extern void h264idr_open(h264idr_context_t** h264idr_context, const void* extradata,
+			 int extradata_size);
+extern void h264idr_close(h264idr_context_t** h264idr_context);
+
+/* Rewrites the IDR slices of the AVPacket in place, packets must come in decoding order. A slice
+   header that cannot be followed is an error, the output would repeat an id otherwise. */
+extern void h264idr_renumber_packet(h264idr_context_t* h264idr_context, void* avpacket);
+
+#endif
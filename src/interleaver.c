@@ -0,0 +1,213 @@
+#include "interleaver.h"
+#include "common/error.h"
+#include "common/trace.h"
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+
+#include <stdlib.h>
+
+#define INTERLEAVER_HEAP_INITIAL_CAPACITY 16
+
+/* Pending packets of one stream, a min-heap on dts */
+struct interleaver_stream {
+  AVPacket** heap;
+  int count;
+  int capacity;
+
+  AVRational time_base;
+  int64_t last_dts; // newest dts put on the stream, AV_NOPTS_VALUE before the first one
+  int finished;
+};
+
+typedef struct interleaver_context {
+  AVFormatContext* format_context;
+  int nb_streams;
+  struct interleaver_stream* streams;
+
+  int64_t max_delay;
+  int64_t newest_dts; // across every stream, in AV_TIME_BASE_Q
+} interleaver_context_t;
+
+static int64_t get_packet_dts(const AVPacket* avpacket) {
+  return avpacket->dts != AV_NOPTS_VALUE ? avpacket->dts : avpacket->pts;
+}
+
+static void push_packet(struct interleaver_stream* stream, AVPacket* avpacket) {
+  if (stream->count == stream->capacity) {
+    int capacity = stream->capacity ? 2 * stream->capacity : INTERLEAVER_HEAP_INITIAL_CAPACITY;
+    AVPacket** heap = (AVPacket**)realloc(stream->heap, capacity * sizeof(AVPacket*));
+    if (!heap) {
+      throw_error("Interleaver allocation failed.", -1);
+    }
+    stream->heap = heap;
+    stream->capacity = capacity;
+  }
+
+  int i = stream->count++;
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (get_packet_dts(stream->heap[parent]) <= get_packet_dts(avpacket)) {
+      break;
+    }
+    stream->heap[i] = stream->heap[parent];
+    i = parent;
+  }
+  stream->heap[i] = avpacket;
+}
+
+static AVPacket* pop_packet(struct interleaver_stream* stream) {
+  AVPacket* top = stream->heap[0];
+  AVPacket* last = stream->heap[--stream->count];
+
+  int i = 0;
+  while (2 * i + 1 < stream->count) {
+    int child = 2 * i + 1;
+    if (child + 1 < stream->count &&
+	get_packet_dts(stream->heap[child + 1]) < get_packet_dts(stream->heap[child])) {
+      child++;
+    }
+    if (get_packet_dts(last) <= get_packet_dts(stream->heap[child])) {
+      break;
+    }
+    stream->heap[i] = stream->heap[child];
+    i = child;
+  }
+  if (stream->count > 0) {
+    stream->heap[i] = last;
+  }
+  return top;
+}
+
+static void write_packet(interleaver_context_t* interleaver_context, AVPacket* avpacket) {
+  trace_begin("mux", avpacket->pts);
+  int status = av_write_frame(interleaver_context->format_context, avpacket);
+  trace_end("mux", TRACE_NO_PTS);
+  if (status < 0) {
+    throw_error("Error during writting to file.", status);
+  }
+  av_packet_free(&avpacket);
+}
+
+/* Nothing earlier than dts can come on a stream that is finished or already went past it */
+static int stream_passed(const struct interleaver_stream* stream, int64_t dts, AVRational time_base) {
+  return stream->finished ||
+    (stream->last_dts != AV_NOPTS_VALUE &&
+     av_compare_ts(stream->last_dts, stream->time_base, dts, time_base) >= 0);
+}
+
+static void write_ready_packets(interleaver_context_t* interleaver_context, int drain) {
+  while (1) {
+    struct interleaver_stream* next = NULL;
+    int64_t next_dts = 0;
+
+    for (int i = 0; i < interleaver_context->nb_streams; i++) {
+      struct interleaver_stream* stream = &interleaver_context->streams[i];
+      if (stream->count == 0) {
+	continue;
+      }
+      int64_t dts = get_packet_dts(stream->heap[0]);
+      if (!next || av_compare_ts(dts, stream->time_base, next_dts, next->time_base) < 0) {
+	next = stream;
+	next_dts = dts;
+      }
+    }
+    if (!next) {
+      return;
+    }
+
+    int ready = 1;
+    for (int i = 0; i < interleaver_context->nb_streams && !drain; i++) {
+      struct interleaver_stream* stream = &interleaver_context->streams[i];
+      if (stream != next && !stream_passed(stream, next_dts, next->time_base)) {
+	ready = 0;
+	break;
+      }
+    }
+
+    // A stream that stalls or runs far behind must not hold the others back indefinitely
+    if (!ready && interleaver_context->newest_dts -
+	av_rescale_q(next_dts, next->time_base, AV_TIME_BASE_Q) > interleaver_context->max_delay) {
+      ready = 1;
+    }
+
+    if (!ready) {
+      return;
+    }
+    write_packet(interleaver_context, pop_packet(next));
+  }
+}
+
+void interleaver_open(interleaver_context_t** interleaver_context, void* format_context,
+		      int64_t max_delay) {
+  interleaver_context_t* context = (interleaver_context_t*)malloc(sizeof(interleaver_context_t));
+  if (!context) {
+    throw_error("Interleaver allocation failed.", -1);
+  }
+
+  context->format_context = (AVFormatContext*)format_context;
+  context->nb_streams = context->format_context->nb_streams;
+  context->max_delay = max_delay;
+  context->newest_dts = INT64_MIN;
+
+  context->streams = (struct interleaver_stream*)calloc(context->nb_streams,
+							sizeof(struct interleaver_stream));
+  if (!context->streams) {
+    throw_error("Interleaver allocation failed.", -1);
+  }
+
+  // Stream time bases are only final once the header has been written
+  for (int i = 0; i < context->nb_streams; i++) {
+    context->streams[i].time_base = context->format_context->streams[i]->time_base;
+    context->streams[i].last_dts = AV_NOPTS_VALUE;
+  }
+
+  *interleaver_context = context;
+}
+
+void interleaver_close(interleaver_context_t** interleaver_context) {
+  interleaver_context_t* context = *interleaver_context;
+
+  write_ready_packets(context, 1);
+  for (int i = 0; i < context->nb_streams; i++) {
+    free(context->streams[i].heap);
+  }
+  free(context->streams);
+  free(context);
+
+  *interleaver_context = NULL;
+}
+
+void interleaver_put_packet(interleaver_context_t* interleaver_context, void* avpacket) {
+  AVPacket* source = (AVPacket*)avpacket;
+  struct interleaver_stream* stream = &interleaver_context->streams[source->stream_index];
+
+  AVPacket* packet = av_packet_alloc();
+  if (!packet) {
+    throw_error("Packet allocation failed.", -1);
+  }
+  av_packet_move_ref(packet, source);
+
+  int64_t dts = get_packet_dts(packet);
+  if (dts == AV_NOPTS_VALUE) {
+    // Nothing to order it by, it goes out in arrival order
+    write_packet(interleaver_context, packet);
+    return;
+  }
+
+  push_packet(stream, packet);
+  stream->last_dts = stream->last_dts == AV_NOPTS_VALUE || dts > stream->last_dts ?
+    dts : stream->last_dts;
+
+  int64_t newest_dts = av_rescale_q(dts, stream->time_base, AV_TIME_BASE_Q);
+  if (newest_dts > interleaver_context->newest_dts) {
+    interleaver_context->newest_dts = newest_dts;
+  }
+
+  write_ready_packets(interleaver_context, 0);
+}
+
+void interleaver_finish_stream(interleaver_context_t* interleaver_context, int stream_index) {
+  interleaver_context->streams[stream_index].finished = 1;
+  write_ready_packets(interleaver_context, 0);
+}
@@ -0,0 +1,23 @@
+#ifndef _INTERLEAVER_H_
+#define _INTERLEAVER_H_
+
+#include <stdint.h>
+
+typedef struct interleaver_context interleaver_context_t;
+
+/*
+ * Orders the packets of every stream of an output AVFormatContext by dts and writes them without
+ * libavformat's own interleaving queue. A packet goes out once every other stream has moved past
+ * it, or once it lags the newest packet by more than max_delay microseconds.
+ */
+extern void interleaver_open(interleaver_context_t** interleaver_context, void* format_context,
+			     int64_t max_delay);
+/* Writes whatever is still pending. */
+extern void interleaver_close(interleaver_context_t** interleaver_context);
+
+/* Takes over the reference of an AVPacket already in its stream's time base. */
+extern void interleaver_put_packet(interleaver_context_t* interleaver_context, void* avpacket);
+/* No more packets come on this stream, the others stop waiting for it. */
+extern void interleaver_finish_stream(interleaver_context_t* interleaver_context, int stream_index);
+
+#endif
@@ -0,0 +1,354 @@
+#include "job.h"
+
+#include "decoder.h"
+#include "encoder.h"
+#include "rescaler.h"
+#include "resampler.h"
+#include "shmoutput.h"
+#include "common/error.h"
+
+#include <libavutil/time.h>
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Process-wide so codec worker threads are counted, only meaningful for a job running alone */
+static int64_t get_cpu_time() {
+  struct timespec now;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void job_init_segment(struct job_segment* segment, const char* input_filename, float start_ts,
+		      float end_ts) {
+  segment->input_filename = input_filename;
+  segment->start_ts = start_ts;
+  segment->end_ts = end_ts;
+  segment->origin_ts = start_ts;
+  segment->end_exclusive = 0;
+  segment->samples_count = 0;
+  segment->encoder_options = NULL;
+  segment->stats = NULL;
+}
+
+int job_get_audio_boundary(float origin_ts, float ts) {
+  int64_t samples = (int64_t)floor((double)(ts - origin_ts) * ENCODER_AUDIO_SAMPLE_RATE);
+  return (int)(samples / ENCODER_AUDIO_FRAME_SIZE * ENCODER_AUDIO_FRAME_SIZE);
+}
+
+/* CPU time since the last lap, which starts the next one */
+static int64_t lap_cpu_time(int64_t* time) {
+  int64_t now = get_cpu_time();
+  int64_t elapsed = now - *time;
+  *time = now;
+  return elapsed;
+}
+
+static void encode_audio_frames(encoder_context_t* encoder_context,
+				resampler_context_t* resampler_context, struct job_stats* stats) {
+  frame_t* audio_frame = NULL;
+  int64_t time = get_cpu_time();
+
+  while ((audio_frame = resampler_take_frame(resampler_context)) != NULL) {
+    encoder_next_frame(encoder_context, audio_frame);
+    frame_free(&audio_frame);
+  }
+  int64_t elapsed = lap_cpu_time(&time);
+  stats->encode_time += elapsed;
+  stats->audio_encode_time += elapsed;
+}
+
+static decoder_context_t* open_segment_decoder(const struct job_segment* segment) {
+  decoder_context_t* decoder_context = NULL;
+
+  decoder_open(&decoder_context, segment->input_filename, segment->start_ts, segment->end_ts);
+  decoder_set_origin(decoder_context, segment->origin_ts);
+  decoder_set_end_exclusive(decoder_context, segment->end_exclusive);
+  return decoder_context;
+}
+
+/* Decodes one range straight into the encoder, frame by frame, and closes its decoder. The
+   resampler may still hold the end of an earlier range. Without a resampler the audio packets are
+   copied as they come. */
+static void decode_segment(decoder_context_t** decoder_context_ptr, encoder_context_t* encoder_context,
+			   rescaler_context_t* rescaler_context, resampler_context_t* resampler_context,
+			   struct job_stats* stats) {
+  frame_t* frames = NULL;
+  decoder_context_t* decoder_context = *decoder_context_ptr;
+  int64_t time = 0;
+
+  decoder_set_audio_passthrough(decoder_context, !resampler_context);
+
+  time = get_cpu_time();
+  while ((frames = decoder_next_frame(decoder_context)) != NULL) {
+    stats->decode_time += lap_cpu_time(&time);
+
+    // One packet may decode into several frames
+    for (frame_t* frame = frames; frame; frame = frame_next(frame)) {
+      struct frame_item* item = frame_get_item(frame);
+
+      if (item->stream_id == FRAME_VIDEO_TYPE) {
+	frame_t* scaled_frame = rescaler_scale_to_frame(rescaler_context, frame);
+	stats->scale_time += lap_cpu_time(&time);
+	stats->video_frames++;
+	if (!scaled_frame) {
+	  stats->duplicate_frames++;
+	  continue;
+	}
+	encoder_next_frame(encoder_context, scaled_frame);
+	frame_free(&scaled_frame);
+	stats->encode_time += lap_cpu_time(&time);
+      } else if (item->stream_id == FRAME_AUDIO_TYPE && !resampler_context) {
+	encoder_next_frame(encoder_context, frame);
+	stats->encode_time += lap_cpu_time(&time);
+	stats->audio_frames++;
+      } else if (item->stream_id == FRAME_AUDIO_TYPE) {
+	resampler_put_frame(resampler_context, frame);
+	stats->resample_time += lap_cpu_time(&time);
+	encode_audio_frames(encoder_context, resampler_context, stats);
+	stats->audio_frames++;
+	time = get_cpu_time();
+      }
+    }
+    frame_free(&frames);
+    time = get_cpu_time();
+  }
+  stats->decode_time += lap_cpu_time(&time);
+  if (stats->first_frame_time < 0) {
+    stats->first_frame_time = decoder_get_first_frame_time(decoder_context);
+  }
+
+  if (resampler_context) {
+    resampler_flush(resampler_context);
+    encode_audio_frames(encoder_context, resampler_context, stats);
+  }
+  decoder_close(decoder_context_ptr);
+}
+
+/* The audio parameters of decoder_context when its audio can be copied into the output */
+static void* find_audio_source(decoder_context_t* decoder_context,
+			       const struct encoder_options* encoder_options) {
+  struct encoder_options default_options;
+
+  if (!encoder_options) {
+    encoder_init_options(&default_options);
+    encoder_options = &default_options;
+  }
+
+  void* codecpar = decoder_get_codec_parameters(decoder_context, FRAME_AUDIO_TYPE);
+  return encoder_can_copy_audio(encoder_options, codecpar) ? codecpar : NULL;
+}
+
+static void open_pipeline(encoder_context_t** encoder_context, const char* output_filename,
+			  const struct encoder_options* encoder_options, const void* audio_codecpar,
+			  rescaler_context_t** rescaler_context, resampler_context_t** resampler_context) {
+  encoder_open_copying_audio(encoder_context, output_filename, encoder_options, audio_codecpar);
+
+  void* video_codec_context = encoder_get_codec_context(*encoder_context, FRAME_VIDEO_TYPE);
+  void* audio_codec_context = encoder_get_codec_context(*encoder_context, FRAME_AUDIO_TYPE);
+
+  rescaler_initialize(rescaler_context, video_codec_context);
+  if (encoder_options) {
+    rescaler_set_duplicate_detection(*rescaler_context, encoder_options->duplicate_threshold,
+				     encoder_options->duplicate_keepalive);
+  }
+  *resampler_context = NULL;
+  if (audio_codec_context) {
+    resampler_initialize(resampler_context, audio_codec_context);
+  }
+}
+
+static void close_pipeline(encoder_context_t** encoder_context, rescaler_context_t** rescaler_context,
+			   resampler_context_t** resampler_context, int whole_frames_only,
+			   struct job_stats* stats) {
+  int64_t time = get_cpu_time();
+
+  // A still ending is closed by the picture it kept showing
+  frame_t* video_frame = rescaler_flush_duplicate(*rescaler_context);
+  if (video_frame) {
+    encoder_next_frame(*encoder_context, video_frame);
+    frame_free(&video_frame);
+  }
+
+  // The last audio frame goes out short, the encoder pads it with silence. Unless this is the real
+  // end that silence would overlap the next segment.
+  if (*resampler_context && (!whole_frames_only ||
+			     resampler_get_pending_samples(*resampler_context) ==
+			     ENCODER_AUDIO_FRAME_SIZE)) {
+    encoder_next_frame(*encoder_context, resampler_get_frame(*resampler_context));
+  }
+  encoder_close(encoder_context);
+  stats->encode_time += get_cpu_time() - time;
+
+  rescaler_free(rescaler_context);
+  if (*resampler_context) {
+    resampler_free(resampler_context);
+  }
+}
+
+void job_transcode(struct job_segment* segment, const char* output_filename) {
+  encoder_context_t* encoder_context = NULL;
+  rescaler_context_t* rescaler_context = NULL;
+  resampler_context_t* resampler_context = NULL;
+
+  struct job_stats stats;
+  int64_t start_time = av_gettime_relative();
+  memset(&stats, 0, sizeof(stats));
+  stats.first_frame_time = -1;
+
+  // The decoder opens first, the encoder needs its audio parameters to decide on copying
+  decoder_context_t* decoder_context = open_segment_decoder(segment);
+  void* audio_codecpar = find_audio_source(decoder_context, segment->encoder_options);
+  open_pipeline(&encoder_context, output_filename, segment->encoder_options, audio_codecpar,
+		&rescaler_context, &resampler_context);
+  // The deadline counts from the start of the job, decoding eats into it as well
+  encoder_set_schedule(encoder_context, segment->start_ts - segment->origin_ts,
+		       segment->end_ts - segment->origin_ts, start_time);
+
+  // Copied audio keeps its source timestamps, there is no sample count to carry on. Re-encoded
+  // audio of a segment followed by another is cut on the frame grid, both sides of a join then
+  // agree on the sample where it lies.
+  int end_sample = -1;
+  if (resampler_context) {
+    if (segment->end_exclusive) {
+      end_sample = job_get_audio_boundary(segment->origin_ts, segment->end_ts);
+    }
+    resampler_set_samples_count(resampler_context, segment->samples_count);
+    resampler_set_sample_window(resampler_context, segment->samples_count, end_sample);
+    decoder_set_audio_start(decoder_context, segment->origin_ts +
+			    (float)segment->samples_count / ENCODER_AUDIO_SAMPLE_RATE);
+  }
+
+  decode_segment(&decoder_context, encoder_context, rescaler_context, resampler_context, &stats);
+  if (resampler_context) {
+    segment->samples_count = end_sample >= 0 ? end_sample :
+      resampler_get_samples_count(resampler_context);
+  }
+
+  close_pipeline(&encoder_context, &rescaler_context, &resampler_context, end_sample >= 0, &stats);
+
+  if (segment->stats) {
+    *segment->stats = stats;
+  }
+}
+
+/* The segment of the index-th piece, placed offset_ts into the output */
+static void init_piece_segment(struct job_segment* segment, const struct job_piece* pieces,
+			       int nb_pieces, int index, float offset_ts) {
+  job_init_segment(segment, pieces[index].input_filename, pieces[index].start_ts,
+		   pieces[index].end_ts);
+  segment->origin_ts = pieces[index].start_ts - offset_ts;
+  segment->end_exclusive = index < nb_pieces - 1;
+}
+
+void job_concat(const struct job_piece* pieces, int nb_pieces,
+		const struct encoder_options* encoder_options, const char* output_filename) {
+  encoder_context_t* encoder_context = NULL;
+  rescaler_context_t* rescaler_context = NULL;
+  resampler_context_t* resampler_context = NULL;
+
+  struct job_stats stats;
+  float offset_ts = 0;
+  float duration = 0;
+  int64_t start_time = av_gettime_relative();
+  memset(&stats, 0, sizeof(stats));
+  stats.first_frame_time = -1;
+
+  for (int i = 0; i < nb_pieces; i++) {
+    if (pieces[i].start_ts > pieces[i].end_ts) {
+      throw_error("Start timestamp < end timestamp.", -1);
+    }
+    duration += pieces[i].end_ts - pieces[i].start_ts;
+  }
+
+  // One encoder session: every piece is shifted to follow the previous one and the audio sample
+  // count simply carries on. Audio is only copied when every piece allows it and the encoder has
+  // to know before the first frame, the pieces after the first are probed for it and each one's
+  // decoder only opens when its turn comes.
+  struct job_segment segment;
+  init_piece_segment(&segment, pieces, nb_pieces, 0, offset_ts);
+  decoder_context_t* decoder_context = open_segment_decoder(&segment);
+
+  void* audio_codecpar = find_audio_source(decoder_context, encoder_options);
+  for (int i = 1; i < nb_pieces && audio_codecpar; i++) {
+    decoder_context_t* probe_context = NULL;
+    decoder_probe(&probe_context, pieces[i].input_filename);
+    if (!find_audio_source(probe_context, encoder_options)) {
+      audio_codecpar = NULL;
+    }
+    decoder_close(&probe_context);
+  }
+
+  open_pipeline(&encoder_context, output_filename, encoder_options, audio_codecpar,
+		&rescaler_context, &resampler_context);
+  encoder_set_schedule(encoder_context, 0, duration, start_time);
+
+  for (int i = 0; i < nb_pieces; i++) {
+    if (i > 0) {
+      init_piece_segment(&segment, pieces, nb_pieces, i, offset_ts);
+      decoder_context = open_segment_decoder(&segment);
+    }
+    decode_segment(&decoder_context, encoder_context, rescaler_context, resampler_context, &stats);
+    offset_ts += pieces[i].end_ts - pieces[i].start_ts;
+  }
+
+  close_pipeline(&encoder_context, &rescaler_context, &resampler_context, 0, &stats);
+}
+
+void job_publish(struct job_segment* segment, const char* shm_name, size_t shm_size) {
+  frame_t* frames = NULL;
+  frame_t* audio_frame = NULL;
+  decoder_context_t* decoder_context = NULL;
+  shmoutput_context_t* shmoutput_context = NULL;
+
+  rescaler_context_t* rescaler_context = NULL;
+  resampler_context_t* resampler_context = NULL;
+
+  decoder_context = open_segment_decoder(segment);
+
+  shmoutput_open(&shmoutput_context, shm_name, shm_size);
+
+  void* video_codec_context = shmoutput_get_codec_context(shmoutput_context, FRAME_VIDEO_TYPE);
+  void* audio_codec_context = shmoutput_get_codec_context(shmoutput_context, FRAME_AUDIO_TYPE);
+
+  rescaler_initialize(&rescaler_context, video_codec_context);
+  resampler_initialize(&resampler_context, audio_codec_context);
+  resampler_set_samples_count(resampler_context, segment->samples_count);
+
+  // Frames go out as soon as they are ready, video is scaled straight into the ring
+  while ((frames = decoder_next_frame(decoder_context)) != NULL) {
+    // One packet may decode into several frames
+    for (frame_t* frame = frames; frame; frame = frame_next(frame)) {
+      struct frame_item* item = frame_get_item(frame);
+      if (item->stream_id == FRAME_VIDEO_TYPE) {
+	void* avframe = shmoutput_reserve_video_frame(shmoutput_context);
+	rescaler_scale_frame(rescaler_context, frame, avframe);
+	shmoutput_commit_video_frame(shmoutput_context);
+      } else if (item->stream_id == FRAME_AUDIO_TYPE) {
+	resampler_put_frame(resampler_context, frame);
+	while ((audio_frame = resampler_take_frame(resampler_context)) != NULL) {
+	  shmoutput_put_audio_frame(shmoutput_context, audio_frame);
+	  frame_free(&audio_frame);
+	}
+      }
+    }
+    frame_free(&frames);
+  }
+
+  resampler_flush(resampler_context);
+  while ((audio_frame = resampler_take_frame(resampler_context)) != NULL) {
+    shmoutput_put_audio_frame(shmoutput_context, audio_frame);
+    frame_free(&audio_frame);
+  }
+
+  // The last audio frame goes out short
+  shmoutput_put_audio_frame(shmoutput_context, resampler_get_frame(resampler_context));
+  segment->samples_count = resampler_get_samples_count(resampler_context);
+
+  shmoutput_close(&shmoutput_context);
+  decoder_close(&decoder_context);
+  rescaler_free(&rescaler_context);
+  resampler_free(&resampler_context);
+}
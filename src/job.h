@@ -0,0 +1,59 @@
+#ifndef _JOB_H_
+#define _JOB_H_
+
+#include "encoder.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CPU time spent in each stage of a segment, in microseconds. */
+struct job_stats {
+  int64_t decode_time;
+  int64_t scale_time;
+  int64_t resample_time;
+  int64_t encode_time;
+  int64_t audio_encode_time; // part of encode_time spent encoding resampled audio
+  int video_frames; // decoded source frames
+  int duplicate_frames; // source frames dropped as duplicates, counted in video_frames
+  int audio_frames;
+  int64_t first_frame_time; // wall time from opening the first input to its first frame, -1 if none
+};
+
+/* One contiguous piece of a source file encoded into one output file. */
+struct job_segment {
+  const char* input_filename;
+  float start_ts;
+  float end_ts;
+
+  float origin_ts;   // source time that maps to zero in the output
+  int end_exclusive; // frames exactly at end_ts belong to the next segment, and re-encoded audio
+		     // stops at the last whole audio frame before it (see job_get_audio_boundary)
+  int samples_count; // audio samples written before this segment, updated when it is done
+
+  const struct encoder_options* encoder_options; // NULL for the defaults
+  struct job_stats* stats;                       // filled in when not NULL
+};
+
+/* One range of a concatenation. */
+struct job_piece {
+  const char* input_filename;
+  float start_ts;
+  float end_ts;
+};
+
+/* Output audio sample, on the whole frame grid counted from origin_ts, where re-encoded audio of
+   a segment ending at ts stops and the next segment's starts. */
+extern int job_get_audio_boundary(float origin_ts, float ts);
+
+extern void job_init_segment(struct job_segment* segment, const char* input_filename, float start_ts,
+			     float end_ts);
+extern void job_transcode(struct job_segment* segment, const char* output_filename);
+
+/* Encodes the pieces back to back into one output in a single encoder session. */
+extern void job_concat(const struct job_piece* pieces, int nb_pieces,
+		       const struct encoder_options* encoder_options, const char* output_filename);
+
+/* Like job_transcode but publishes the raw frames into a shared memory ring, nothing is encoded. */
+extern void job_publish(struct job_segment* segment, const char* shm_name, size_t shm_size);
+
+#endif
@@ -1,61 +1,344 @@
 #include "common/basename.h"
 #include "common/error.h"
+#include "common/trace.h"
 
 #include <libavformat/avformat.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "batch.h"
+#include "cache.h"
+#include "checkpoint.h"
 #include "decoder.h"
 #include "encoder.h"
-#include "rescaler.h"
-#include "resampler.h"
+#include "estimator.h"
+#include "job.h"
+
+#define DEFAULT_CACHE_SIZE_MB 10240
+#define DEFAULT_CHUNK_LENGTH 120.0f
+#define DEFAULT_SHM_SIZE_MB 64
+
+enum option_id {
+  OPTION_CACHE_DIR = 256,
+  OPTION_CACHE_SIZE,
+  OPTION_CACHE_FINGERPRINT,
+  OPTION_CHECKPOINT_INTERVAL,
+  OPTION_PRESET,
+  OPTION_BATCH,
+  OPTION_JOBS,
+  OPTION_CHUNK_LENGTH,
+  OPTION_ESTIMATE,
+  OPTION_CALIBRATION,
+  OPTION_CALIBRATE,
+  OPTION_SHM,
+  OPTION_SHM_SIZE,
+  OPTION_REALTIME_FACTOR,
+  OPTION_PARALLEL_ENCODERS,
+  OPTION_AUDIO_REENCODE,
+  OPTION_PROBE_SIZE,
+  OPTION_STREAM_PROFILES,
+  OPTION_DUPLICATE_THRESHOLD,
+  OPTION_DUPLICATE_KEEPALIVE,
+  OPTION_TRACE,
+};
+
+static const struct option long_options[] = {
+  { "cache-dir", required_argument, NULL, OPTION_CACHE_DIR },
+  { "cache-size", required_argument, NULL, OPTION_CACHE_SIZE },
+  { "cache-fingerprint", no_argument, NULL, OPTION_CACHE_FINGERPRINT },
+  { "checkpoint-interval", required_argument, NULL, OPTION_CHECKPOINT_INTERVAL },
+  { "preset", required_argument, NULL, OPTION_PRESET },
+  { "batch", required_argument, NULL, OPTION_BATCH },
+  { "jobs", required_argument, NULL, OPTION_JOBS },
+  { "chunk-length", required_argument, NULL, OPTION_CHUNK_LENGTH },
+  { "estimate", no_argument, NULL, OPTION_ESTIMATE },
+  { "calibration", required_argument, NULL, OPTION_CALIBRATION },
+  { "calibrate", required_argument, NULL, OPTION_CALIBRATE },
+  { "shm", required_argument, NULL, OPTION_SHM },
+  { "shm-size", required_argument, NULL, OPTION_SHM_SIZE },
+  { "realtime-factor", required_argument, NULL, OPTION_REALTIME_FACTOR },
+  { "parallel-encoders", required_argument, NULL, OPTION_PARALLEL_ENCODERS },
+  { "audio-reencode", no_argument, NULL, OPTION_AUDIO_REENCODE },
+  { "probe-size", required_argument, NULL, OPTION_PROBE_SIZE },
+  { "stream-profiles", required_argument, NULL, OPTION_STREAM_PROFILES },
+  { "duplicate-threshold", required_argument, NULL, OPTION_DUPLICATE_THRESHOLD },
+  { "duplicate-keepalive", required_argument, NULL, OPTION_DUPLICATE_KEEPALIVE },
+  { "trace", required_argument, NULL, OPTION_TRACE },
+  { NULL, 0, NULL, 0 },
+};
+
+struct options {
+  const char* cache_dir;
+  int64_t cache_size;
+  int cache_fingerprint;
+  float checkpoint_interval;
+  struct encoder_options encoder_options;
+  struct decoder_options decoder_options;
+
+  const char* batch_manifest;
+  int batch_jobs;
+  float chunk_length;
+
+  int estimate;
+  const char* calibration_file;
+  const char* calibrate_file;
+
+  const char* shm_name;
+  size_t shm_size;
+};
+
+static void parse_options(struct options* options, int argc, char* argv[]) {
+  int option = 0;
+
+  options->cache_dir = NULL;
+  options->cache_size = (int64_t)DEFAULT_CACHE_SIZE_MB << 20;
+  options->cache_fingerprint = 0;
+  options->checkpoint_interval = 0;
+  encoder_init_options(&options->encoder_options);
+  decoder_init_options(&options->decoder_options);
+
+  options->batch_manifest = NULL;
+  options->batch_jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  options->chunk_length = DEFAULT_CHUNK_LENGTH;
+
+  options->estimate = 0;
+  options->calibration_file = NULL;
+  options->calibrate_file = NULL;
+
+  options->shm_name = NULL;
+  options->shm_size = (size_t)DEFAULT_SHM_SIZE_MB << 20;
+
+  while ((option = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (option) {
+    case OPTION_CACHE_DIR:
+      options->cache_dir = optarg;
+      break;
+    case OPTION_CACHE_SIZE:
+      options->cache_size = strtoll(optarg, NULL, 10) << 20;
+      break;
+    case OPTION_CACHE_FINGERPRINT:
+      options->cache_fingerprint = 1;
+      break;
+    case OPTION_CHECKPOINT_INTERVAL:
+      options->checkpoint_interval = strtof(optarg, NULL);
+      break;
+    case OPTION_PRESET:
+      options->encoder_options.preset = optarg;
+      break;
+    case OPTION_BATCH:
+      options->batch_manifest = optarg;
+      break;
+    case OPTION_JOBS:
+      options->batch_jobs = (int)strtol(optarg, NULL, 10);
+      break;
+    case OPTION_CHUNK_LENGTH:
+      options->chunk_length = strtof(optarg, NULL);
+      break;
+    case OPTION_ESTIMATE:
+      options->estimate = 1;
+      break;
+    case OPTION_CALIBRATION:
+      options->calibration_file = optarg;
+      break;
+    case OPTION_CALIBRATE:
+      options->calibrate_file = optarg;
+      break;
+    case OPTION_SHM:
+      options->shm_name = optarg;
+      break;
+    case OPTION_SHM_SIZE:
+      options->shm_size = (size_t)strtoll(optarg, NULL, 10) << 20;
+      break;
+    case OPTION_REALTIME_FACTOR:
+      options->encoder_options.realtime_factor = strtof(optarg, NULL);
+      break;
+    case OPTION_PARALLEL_ENCODERS:
+      options->encoder_options.parallel_contexts = (int)strtol(optarg, NULL, 10);
+      break;
+    case OPTION_AUDIO_REENCODE:
+      options->encoder_options.audio_passthrough = 0;
+      break;
+    case OPTION_PROBE_SIZE:
+      options->decoder_options.probe_size = strtoll(optarg, NULL, 10);
+      break;
+    case OPTION_STREAM_PROFILES:
+      options->decoder_options.profile_dir = optarg;
+      break;
+    case OPTION_DUPLICATE_THRESHOLD:
+      options->encoder_options.duplicate_threshold = strtof(optarg, NULL);
+      break;
+    case OPTION_DUPLICATE_KEEPALIVE:
+      options->encoder_options.duplicate_keepalive = strtof(optarg, NULL);
+      break;
+    case OPTION_TRACE:
+      trace_open(optarg);
+      break;
+    default:
+      throw_error("Unknown option.", -1);
+    }
+  }
+}
+
+static void transcode(const struct options* options, const char* input_filename,
+		      float start_timestamp, float end_timestamp, const char* checkpoint_filename,
+		      const char* output_filename) {
+  struct job_segment segment;
+
+  if (options->checkpoint_interval > 0) {
+    checkpoint_transcode(input_filename, start_timestamp, end_timestamp,
+			 options->checkpoint_interval, &options->encoder_options,
+			 checkpoint_filename, output_filename);
+    return;
+  }
+
+  struct job_stats stats;
+  char message[64];
+
+  job_init_segment(&segment, input_filename, start_timestamp, end_timestamp);
+  segment.encoder_options = &options->encoder_options;
+  segment.stats = &stats;
+  job_transcode(&segment, output_filename);
+
+  if (stats.first_frame_time >= 0) {
+    snprintf(message, sizeof(message), "first frame after %.1f ms", stats.first_frame_time / 1e3);
+    throw_warning(message);
+  }
+  if (stats.duplicate_frames > 0) {
+    snprintf(message, sizeof(message), "%d of %d frames dropped as duplicates",
+	     stats.duplicate_frames, stats.video_frames);
+    throw_warning(message);
+  }
+}
+
+static void transcode_cached(const struct options* options, const char* input_filename,
+			     float start_timestamp, float end_timestamp, const char* output_filename) {
+  char key[CACHE_KEY_SIZE];
+  char settings[256];
+  char temp_filename[PATH_MAX];
+  cache_context_t* cache_context = NULL;
+
+  cache_open(&cache_context, options->cache_dir, options->cache_size, options->cache_fingerprint);
+
+  encoder_get_settings(&options->encoder_options, settings, sizeof(settings));
+  cache_make_key(cache_context, input_filename, start_timestamp, end_timestamp, settings,
+		 output_filename, key);
+
+  if (cache_fetch(cache_context, key, output_filename)) {
+    throw_warning("Output served from the cache.");
+  } else {
+    cache_get_temp_filename(output_filename, temp_filename, sizeof(temp_filename));
+    transcode(options, input_filename, start_timestamp, end_timestamp, output_filename,
+	      temp_filename);
+    cache_publish(cache_context, key, temp_filename, output_filename);
+  }
+
+  cache_close(&cache_context);
+}
+
+static void concat(const struct options* options, int nb_pieces, char* arguments[],
+		   const char* output_filename) {
+  struct job_piece* pieces = (struct job_piece*)malloc(nb_pieces * sizeof(struct job_piece));
+  if (!pieces) {
+    throw_error("Piece list allocation failed.", -1);
+  }
+
+  for (int i = 0; i < nb_pieces; i++) {
+    pieces[i].input_filename = arguments[3 * i];
+    pieces[i].start_ts = (float)strtol(arguments[3 * i + 1], NULL, 10);
+    pieces[i].end_ts = (float)strtol(arguments[3 * i + 2], NULL, 10);
+  }
+
+  av_register_all();
+  job_concat(pieces, nb_pieces, &options->encoder_options, output_filename);
+  free(pieces);
+}
 
 int main(int argc, char* argv[]) {
+  struct options options;
+
   set_basename(argv[0]);
+  parse_options(&options, argc, argv);
+  decoder_set_options(&options.decoder_options);
+
+  if (options.batch_manifest) {
+    // Batch jobs are already cut into chunks that are joined at the end, the cache and
+    // checkpoints would have to be kept per chunk
+    if (options.cache_dir || options.checkpoint_interval > 0 || options.calibrate_file ||
+	options.estimate || options.shm_name) {
+      throw_error("Batch mode cannot be combined with the cache, checkpoints, calibration, estimates or shared memory output.", -1);
+    }
+    av_register_all();
+    // The pool already keeps every core busy, one encoder thread per job avoids oversubscription
+    options.encoder_options.thread_count = 1;
+    options.encoder_options.parallel_contexts = 0;
+    int nb_failed = batch_run(options.batch_manifest, options.batch_jobs, options.chunk_length,
+			      &options.encoder_options);
+    return nb_failed > 0 ? 1 : 0;
+  }
 
-  if (argc < 5) {
+  // Estimates and shared memory output need no output file
+  int nb_arguments = argc - optind;
+  if (nb_arguments < (options.estimate || options.shm_name ? 3 : 4)) {
     throw_error("Not enought arguments.", -1);
   }
-  
-  frame_t* frame = NULL;
-  decoder_context_t* decoder_context = NULL;
-  encoder_context_t* encoder_context = NULL;
+  argv += optind;
 
-  rescaler_context_t* rescaler_context = NULL;
-  resampler_context_t* resampler_context = NULL;
+  // The ring carries raw frames, nothing encoder or output file related applies to it
+  if (options.shm_name &&
+      (options.cache_dir || options.checkpoint_interval > 0 || options.calibrate_file ||
+       options.estimate || options.encoder_options.duplicate_threshold > 0 ||
+       strcmp(options.encoder_options.preset, ENCODER_VIDEO_DEFAULT_PRESET))) {
+    throw_error("Shared memory output cannot be combined with the cache, checkpoints, calibration, estimates, a preset or duplicate detection.", -1);
+  }
+  if ((options.estimate || options.shm_name) && nb_arguments > 3) {
+    throw_error("Estimates and shared memory output take a single INPUT START END.", -1);
+  }
 
-  float start_timestamp = (float)strtol(argv[2], NULL, 10);
-  float end_timestamp = (float)strtol(argv[3], NULL, 10);
-  
-  av_register_all();
-  
-  decoder_open(&decoder_context, argv[1], start_timestamp, end_timestamp);
-  encoder_open(&encoder_context, argv[4]);
-
-  void* video_codec_context = encoder_get_codec_context(encoder_context, FRAME_VIDEO_TYPE);
-  void* audio_codec_context = encoder_get_codec_context(encoder_context, FRAME_AUDIO_TYPE);
-
-  rescaler_initialize(&rescaler_context, video_codec_context);
-  resampler_initialize(&resampler_context, audio_codec_context);
-
-  while ((frame = decoder_next_frame(decoder_context)) != NULL) {
-    struct frame_item* item = frame_get_item(frame);
-    if (item->stream_id == FRAME_VIDEO_TYPE) {
-      rescaler_put_frame(rescaler_context, frame);
-    } else if (item->stream_id == FRAME_AUDIO_TYPE) {
-      resampler_put_frame(resampler_context, frame);
+  // More than one INPUT START END triple before the output concatenates the ranges
+  if (!options.estimate && !options.shm_name && nb_arguments > 4) {
+    if ((nb_arguments - 1) % 3 != 0) {
+      throw_error("Every piece needs an input, a start and an end.", -1);
+    }
+    if (options.cache_dir || options.checkpoint_interval > 0 || options.calibrate_file) {
+      throw_error("Concatenation cannot be combined with the cache, checkpoints or calibration.", -1);
     }
-    frame_free(&frame);
+    concat(&options, nb_arguments / 3, argv, argv[nb_arguments - 1]);
+    return 0;
+  }
+
+  float start_timestamp = (float)strtol(argv[1], NULL, 10);
+  float end_timestamp = (float)strtol(argv[2], NULL, 10);
+
+  av_register_all();
+
+  if (options.estimate) {
+    estimator_run(argv[0], start_timestamp, end_timestamp, options.calibration_file,
+		  &options.encoder_options);
+    return 0;
+  }
+
+  if (options.shm_name) {
+    struct job_segment segment;
+    job_init_segment(&segment, argv[0], start_timestamp, end_timestamp);
+    job_publish(&segment, options.shm_name, options.shm_size);
+    return 0;
   }
 
-  frame_t* video_frame = rescaler_get_frame(rescaler_context);
-  frame_t* audio_frame = resampler_get_frame(resampler_context);
-  
-  encoder_set_frames(encoder_context, video_frame, audio_frame);
+  if (options.calibrate_file) {
+    estimator_calibrate(argv[0], start_timestamp, end_timestamp, argv[3], options.calibrate_file,
+			&options.encoder_options);
+    return 0;
+  }
+
+  if (options.cache_dir) {
+    transcode_cached(&options, argv[0], start_timestamp, end_timestamp, argv[3]);
+  } else {
+    transcode(&options, argv[0], start_timestamp, end_timestamp, argv[3], argv[3]);
+  }
 
-  encoder_close(&encoder_context);
-  decoder_close(&decoder_context);
-  rescaler_free(&rescaler_context);
-  resampler_free(&resampler_context);
-  
   return 0;
 }
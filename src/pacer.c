@@ -0,0 +1,131 @@
+#include "pacer.h"
+#include "common/error.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PACER_MIN_WINDOW 2000000 // wall microseconds measured before a preset is judged
+#define PACER_SLOWDOWN_COST 1.6  // a slower preset never measured is assumed this much slower
+#define PACER_SLOWDOWN_MARGIN 1.15 // slack a slower preset still has to leave
+
+static const char* const preset_ladder[] = {
+  "ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow", "slower", "veryslow",
+};
+
+#define PACER_NB_PRESETS ((int)(sizeof(preset_ladder) / sizeof(preset_ladder[0])))
+
+typedef struct pacer_context {
+  int preset_index;
+  float duration;
+  int64_t deadline;
+
+  // Throughput is measured since the last switch, the previous preset says nothing about this one
+  int64_t window_time;
+  float window_ts;
+
+  double throughput_table[PACER_NB_PRESETS]; // last measurement of each preset, 0 if none
+} pacer_context_t;
+
+static int find_preset(const char* preset) {
+  for (int i = 0; i < PACER_NB_PRESETS; i++) {
+    if (!strcmp(preset_ladder[i], preset)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void pacer_open(pacer_context_t** pacer_context, const char* preset, float duration,
+		int64_t deadline) {
+  pacer_context_t* context = (pacer_context_t*)malloc(sizeof(pacer_context_t));
+  if (!context) {
+    throw_error("Pacer allocation failed.", -1);
+  }
+
+  context->preset_index = find_preset(preset);
+  if (context->preset_index < 0) {
+    throw_error("Adaptive encoding speed needs one of the standard x264 presets.", -1);
+  }
+
+  context->duration = duration;
+  context->deadline = deadline;
+  context->window_time = -1;
+  context->window_ts = 0;
+  for (int i = 0; i < PACER_NB_PRESETS; i++) {
+    context->throughput_table[i] = 0;
+  }
+
+  *pacer_context = context;
+}
+
+void pacer_close(pacer_context_t** pacer_context) {
+  free(*pacer_context);
+  *pacer_context = NULL;
+}
+
+const char* pacer_update(pacer_context_t* pacer_context, float progress_ts, int64_t now) {
+  char message[256];
+  int64_t elapsed = now - pacer_context->window_time;
+  int index = pacer_context->preset_index;
+
+  // Whatever ran before the first frame (decoding, scaling) is not encoder throughput
+  if (pacer_context->window_time < 0) {
+    pacer_context->window_time = now;
+    pacer_context->window_ts = progress_ts;
+    return NULL;
+  }
+
+  if (elapsed < PACER_MIN_WINDOW || progress_ts <= pacer_context->window_ts) {
+    return NULL;
+  }
+
+  // Content seconds encoded per wall second with the current preset
+  double throughput = (progress_ts - pacer_context->window_ts) / (elapsed / 1e6);
+  double remaining = pacer_context->duration - progress_ts;
+  double time_left = (pacer_context->deadline - now) / 1e6;
+  double slack = time_left > 0 ? time_left / (remaining / throughput) : 0;
+
+  pacer_context->throughput_table[index] = throughput;
+
+  if (slack < 1.0) {
+    // Behind schedule: speed up when a faster preset is left, never slow down
+    if (index > 0) {
+      index--;
+    }
+  } else if (index < PACER_NB_PRESETS - 1) {
+    // Going back to a preset that was already too slow would only oscillate
+    double slower_throughput = pacer_context->throughput_table[index + 1];
+    if (slower_throughput <= 0) {
+      slower_throughput = throughput / PACER_SLOWDOWN_COST;
+    }
+    if (time_left > 0 && time_left / (remaining / slower_throughput) > PACER_SLOWDOWN_MARGIN) {
+      index++;
+    }
+  }
+
+  if (index == pacer_context->preset_index) {
+    return NULL;
+  }
+
+  snprintf(message, sizeof(message),
+	   "pacer: at %.2f s preset %s -> %s, %.2f content s/s, %.1f s left for %.1f s, slack %.2f",
+	   progress_ts, preset_ladder[pacer_context->preset_index], preset_ladder[index], throughput,
+	   time_left, remaining, slack);
+  throw_warning(message);
+
+  pacer_context->preset_index = index;
+  pacer_context->window_time = now;
+  pacer_context->window_ts = progress_ts;
+  return preset_ladder[index];
+}
+
+double pacer_get_relative_cost(const char* preset, const char* reference) {
+  int index = find_preset(preset);
+  int reference_index = find_preset(reference);
+  if (index < 0 || reference_index < 0) {
+    return 0;
+  }
+  return pow(PACER_SLOWDOWN_COST, index - reference_index);
+}
@@ -0,0 +1,24 @@
+#ifndef _PACER_H_
+#define _PACER_H_
+
+#include <stdint.h>
+
+typedef struct pacer_context pacer_context_t;
+
+/*
+ * Keeps an encode on schedule by moving along the x264 preset ladder: duration seconds of
+ * content have to be encoded by deadline, both times in av_gettime_relative() microseconds.
+ */
+extern void pacer_open(pacer_context_t** pacer_context, const char* preset, float duration,
+		       int64_t deadline);
+extern void pacer_close(pacer_context_t** pacer_context);
+
+/* Called at GOP boundaries with the content time reached so far, returns the preset to switch
+   to and logs the decision, or NULL to keep the current one. */
+extern const char* pacer_update(pacer_context_t* pacer_context, float progress_ts, int64_t now);
+
+/* Encoding time with preset relative to reference, by the cost the ladder assumes per step, 0 when
+   either is not on the ladder. */
+extern double pacer_get_relative_cost(const char* preset, const char* reference);
+
+#endif
@@ -1,7 +1,11 @@
 #include "resampler.h"
+#include "decoder.h"
 #include "common/error.h"
+#include "common/trace.h"
 
 #include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
 
 #include <stdlib.h>
 #include <string.h>
@@ -11,6 +15,21 @@ typedef struct resampler_context {
   frame_t* list;
 
   int samples_count;
+
+  // Samples outside [window_start, window_end) of the output are cut away, positions come from the
+  // source timestamps
+  int windowed;
+  int64_t window_start;
+  int64_t window_end; // -1 for none
+  int64_t next_position; // output sample right after the last one put in, -1 before the first
+
+  // Converts sources whose format differs from the codec's, set up for the last one seen
+  struct SwrContext* swr_context;
+  int src_format;
+  int src_sample_rate;
+  uint64_t src_channel_layout;
+  AVFrame* converted_frame;
+  int converted_capacity;
 } resampler_context_t;
 
 AVFrame* allocate_audio_frame(enum AVSampleFormat sample_fmt, uint64_t channel_layout, int sample_rate,
@@ -64,17 +83,15 @@ void allocate_audio_frame_item(resampler_context_t* resampler_context) {
   set_audio_timestamp(resampler_context, new_frame);
 }
 
-void resample_audio_frame(resampler_context_t* resampler_context, frame_t* frame, int offset) {
+void resample_audio_frame(resampler_context_t* resampler_context, AVFrame* src_avframe, int offset,
+			  int end) {
   frame_t* resampled_frame = frame_last(resampler_context->list);
-
-  struct frame_item* src_item = frame_get_item(frame);
   struct frame_item* dst_item = frame_get_item(resampled_frame);
 
   AVCodecContext* codec_context = resampler_context->audio_codec_context;
-  AVFrame* src_avframe = (AVFrame*)src_item->buffer;
   AVFrame* dst_avframe = (AVFrame*)dst_item->buffer;
   
-  int src_nb_samples = src_avframe->nb_samples - offset;
+  int src_nb_samples = end - offset;
   int dst_nb_samples = codec_context->frame_size - dst_avframe->nb_samples;
   int min_nb_samples = fmin(src_nb_samples, dst_nb_samples);
 
@@ -82,7 +99,7 @@ void resample_audio_frame(resampler_context_t* resampler_context, frame_t* frame
   float** dst_data = (float**)dst_avframe->data;
   
   for (int i = 0; i < min_nb_samples; i++) {
-    for (int j = 0; j < src_avframe->channels; j++) {
+    for (int j = 0; j < codec_context->channels; j++) {
       dst_data[j][dst_avframe->nb_samples + i] = src_data[j][offset + i];
     }
   }
@@ -90,8 +107,121 @@ void resample_audio_frame(resampler_context_t* resampler_context, frame_t* frame
 
   if ((src_nb_samples - min_nb_samples) > 0) {
     allocate_audio_frame_item(resampler_context);
-    resample_audio_frame(resampler_context, frame, offset + min_nb_samples);
+    resample_audio_frame(resampler_context, src_avframe, offset + min_nb_samples, end);
+  }
+}
+
+/* Queues the samples of avframe (in the codec format) that fall inside the window, position is the
+   output sample of its first one */
+void put_audio_samples(resampler_context_t* resampler_context, AVFrame* avframe, int64_t position) {
+  int offset = 0;
+  int end = avframe->nb_samples;
+
+  if (resampler_context->windowed) {
+    if (position < resampler_context->window_start) {
+      offset = (int)FFMIN(resampler_context->window_start - position, end);
+    }
+    if (resampler_context->window_end >= 0 && position + end > resampler_context->window_end) {
+      end = (int)FFMAX(resampler_context->window_end - position, offset);
+    }
+  }
+  resampler_context->next_position = position + avframe->nb_samples;
+
+  if (end > offset) {
+    resample_audio_frame(resampler_context, avframe, offset, end);
+  }
+}
+
+int match_codec_format(resampler_context_t* resampler_context, AVFrame* avframe) {
+  AVCodecContext* codec_context = resampler_context->audio_codec_context;
+
+  return avframe->format == codec_context->sample_fmt &&
+    avframe->sample_rate == codec_context->sample_rate &&
+    avframe->channels == codec_context->channels;
+}
+
+void reserve_converted_frame(resampler_context_t* resampler_context, int nb_samples) {
+  AVCodecContext* codec_context = resampler_context->audio_codec_context;
+
+  if (resampler_context->converted_frame && resampler_context->converted_capacity >= nb_samples) {
+    return;
+  }
+
+  av_frame_free(&resampler_context->converted_frame);
+  resampler_context->converted_frame = allocate_audio_frame(codec_context->sample_fmt,
+							    codec_context->channel_layout,
+							    codec_context->sample_rate, nb_samples);
+  resampler_context->converted_capacity = nb_samples;
+}
+
+/* Pushes out the samples the converter still holds back for filtering */
+void drain_audio_converter(resampler_context_t* resampler_context) {
+  if (!resampler_context->swr_context) {
+    return;
+  }
+
+  int nb_samples = swr_get_out_samples(resampler_context->swr_context, 0);
+  if (nb_samples <= 0) {
+    return;
+  }
+  reserve_converted_frame(resampler_context, nb_samples);
+
+  AVFrame* converted_frame = resampler_context->converted_frame;
+  int status = swr_convert(resampler_context->swr_context, converted_frame->data, nb_samples, NULL, 0);
+  if (status < 0) {
+    throw_error("Error draining the audio converter.", status);
+  }
+
+  converted_frame->nb_samples = status;
+  if (status > 0) {
+    put_audio_samples(resampler_context, converted_frame, resampler_context->next_position);
+  }
+}
+
+void setup_audio_converter(resampler_context_t* resampler_context, AVFrame* avframe,
+			   uint64_t channel_layout) {
+  AVCodecContext* codec_context = resampler_context->audio_codec_context;
+
+  if (resampler_context->swr_context && resampler_context->src_format == avframe->format &&
+      resampler_context->src_sample_rate == avframe->sample_rate &&
+      resampler_context->src_channel_layout == channel_layout) {
+    return;
   }
+
+  drain_audio_converter(resampler_context);
+  swr_free(&resampler_context->swr_context);
+
+  resampler_context->swr_context =
+    swr_alloc_set_opts(NULL, codec_context->channel_layout, codec_context->sample_fmt,
+		       codec_context->sample_rate, channel_layout, avframe->format,
+		       avframe->sample_rate, 0, NULL);
+  if (!resampler_context->swr_context || swr_init(resampler_context->swr_context) < 0) {
+    throw_error("Could not create an audio converter for the source format.", -1);
+  }
+
+  resampler_context->src_format = avframe->format;
+  resampler_context->src_sample_rate = avframe->sample_rate;
+  resampler_context->src_channel_layout = channel_layout;
+}
+
+AVFrame* convert_audio_frame(resampler_context_t* resampler_context, AVFrame* avframe) {
+  uint64_t channel_layout = avframe->channel_layout ? avframe->channel_layout :
+    (uint64_t)av_get_default_channel_layout(avframe->channels);
+
+  setup_audio_converter(resampler_context, avframe, channel_layout);
+
+  int nb_samples = swr_get_out_samples(resampler_context->swr_context, avframe->nb_samples);
+  reserve_converted_frame(resampler_context, nb_samples);
+
+  AVFrame* converted_frame = resampler_context->converted_frame;
+  int status = swr_convert(resampler_context->swr_context, converted_frame->data, nb_samples,
+			   (const uint8_t**)avframe->extended_data, avframe->nb_samples);
+  if (status < 0) {
+    throw_error("Error converting audio samples.", status);
+  }
+
+  converted_frame->nb_samples = status;
+  return converted_frame;
 }
 
 void resampler_initialize(resampler_context_t** resampler_context, void* codec_context) {
@@ -101,6 +231,13 @@ void resampler_initialize(resampler_context_t** resampler_context, void* codec_c
   context->list = frame_alloc(FRAME_AUDIO_TYPE);
   context->audio_codec_context = codec_cxt;
   context->samples_count = 0;
+  context->windowed = 0;
+  context->window_start = 0;
+  context->window_end = -1;
+  context->next_position = -1;
+  context->swr_context = NULL;
+  context->converted_frame = NULL;
+  context->converted_capacity = 0;
   
   struct frame_item* item = frame_get_item(context->list);
   item->stream_id = FRAME_AUDIO_TYPE;
@@ -116,15 +253,79 @@ void resampler_free(resampler_context_t** resampler_context) {
   if (context->list) {
     frame_free(&context->list);
   }
+  swr_free(&context->swr_context);
+  av_frame_free(&context->converted_frame);
   free(context);
 
   context = NULL;
 }
 
 void resampler_put_frame(resampler_context_t* resampler_context, frame_t* frame) { 
-  resample_audio_frame(resampler_context, frame, 0);
+  AVFrame* avframe = (AVFrame*)frame_get_item(frame)->buffer;
+  int sample_rate = resampler_context->audio_codec_context->sample_rate;
+  int64_t position = av_rescale(avframe->pts, sample_rate, DECODER_TIME_BASE_DEN);
+
+  // Timestamps are rounded to DECODER_TIME_BASE, contiguous frames follow on from the last one so
+  // that only the first of a segment carries that error and both of its cuts share it
+  if (resampler_context->next_position >= 0 &&
+      llabs(position - resampler_context->next_position) <= sample_rate / DECODER_TIME_BASE_DEN) {
+    position = resampler_context->next_position;
+  }
+
+  trace_begin("repacketize", avframe->pts);
+  if (match_codec_format(resampler_context, avframe)) {
+    put_audio_samples(resampler_context, avframe, position);
+  } else {
+    // Converted samples start where the source frame does, the converter delay is left out
+    put_audio_samples(resampler_context, convert_audio_frame(resampler_context, avframe), position);
+  }
+  trace_end("repacketize", TRACE_NO_PTS);
+}
+
+void resampler_flush(resampler_context_t* resampler_context) {
+  drain_audio_converter(resampler_context);
 }
 
 frame_t* resampler_get_frame(resampler_context_t* resampler_context) {
   return resampler_context->list;
 }
+
+void resampler_set_samples_count(resampler_context_t* resampler_context, int samples_count) {
+  struct frame_item* item = frame_get_item(frame_last(resampler_context->list));
+  AVCodecContext* codec_context = resampler_context->audio_codec_context;
+  AVFrame* avframe = (AVFrame*)item->buffer;
+
+  resampler_context->samples_count = samples_count;
+  avframe->pts = av_rescale_q(samples_count, (AVRational){ 1, codec_context->sample_rate },
+			      codec_context->time_base);
+}
+
+void resampler_set_sample_window(resampler_context_t* resampler_context, int64_t start_sample,
+				  int64_t end_sample) {
+  resampler_context->windowed = 1;
+  resampler_context->window_start = start_sample;
+  resampler_context->window_end = end_sample;
+}
+
+int resampler_get_pending_samples(resampler_context_t* resampler_context) {
+  struct frame_item* item = frame_get_item(frame_last(resampler_context->list));
+  return ((AVFrame*)item->buffer)->nb_samples;
+}
+
+int resampler_get_samples_count(resampler_context_t* resampler_context) {
+  struct frame_item* item = frame_get_item(frame_last(resampler_context->list));
+  AVFrame* avframe = (AVFrame*)item->buffer;
+
+  return resampler_context->samples_count + avframe->nb_samples;
+}
+
+frame_t* resampler_take_frame(resampler_context_t* resampler_context) {
+  frame_t* frame = resampler_context->list;
+
+  // The last frame is still being filled
+  if (!frame_next(frame)) {
+    return NULL;
+  }
+  resampler_context->list = frame_detach(frame);
+  return frame;
+}
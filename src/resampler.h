@@ -3,12 +3,32 @@
 
 #include "frame.h"
 
+#include <stdint.h>
+
 typedef struct resampler_context resampler_context_t;
 
 extern void resampler_initialize(resampler_context_t** resampler_context, void* codec_context);
 extern void resampler_free(resampler_context_t** resampler_context);
 
+/* Frames in another sample format, rate or layout than the codec's are converted first. */
 extern void resampler_put_frame(resampler_context_t* resampler_context, frame_t* frame);
+/* Takes the samples still held in the converter at the end of a source. */
+extern void resampler_flush(resampler_context_t* resampler_context);
 extern frame_t* resampler_get_frame(resampler_context_t* resampler_context);
+/* Hands over the oldest complete frame, NULL while only the one being filled is left. */
+extern frame_t* resampler_take_frame(resampler_context_t* resampler_context);
+
+/* Audio timestamps are derived from the number of samples already written, which has to carry
+   over when one output is produced in several pieces. */
+extern void resampler_set_samples_count(resampler_context_t* resampler_context, int samples_count);
+extern int resampler_get_samples_count(resampler_context_t* resampler_context);
+
+/* Keeps only the output samples from start_sample up to end_sample (-1 for no end), counted from
+   the origin of the decoded timestamps. Frames are placed by their pts, so a range cut on codec
+   frame boundaries joins the next one without a gap or an overlap. */
+extern void resampler_set_sample_window(resampler_context_t* resampler_context, int64_t start_sample,
+					int64_t end_sample);
+/* Samples in the frame still being filled. */
+extern int resampler_get_pending_samples(resampler_context_t* resampler_context);
 
 #endif
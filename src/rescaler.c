@@ -1,5 +1,9 @@
 #include "rescaler.h"
+#include "decoder.h"
+#include "fastscale.h"
+#include "framediff.h"
 #include "common/error.h"
+#include "common/trace.h"
 
 #include <libavutil/imgutils.h>
 #include <libavcodec/avcodec.h>
@@ -12,10 +16,22 @@
 #define DEFAULT_FORMAT AV_PIX_FMT_YUV420P
 
 typedef struct rescaler_context {
-  AVCodecContext* video_codec_context;
+  // Copied from the codec context, which the encoder may replace while frames are scaled
+  int width;
+  int height;
+  enum AVPixelFormat pix_fmt;
+  AVRational time_base;
   struct SwsContext* sws_context;
-  
-  frame_t* list;
+  fastscale_context_t* fastscale_context;
+
+  // Duplicate detection, compared against the last picture that was kept rather than the previous
+  // one so that a slow fade cannot slip through a frame at a time
+  float duplicate_threshold;
+  int64_t duplicate_keepalive; // in DECODER_TIME_BASE_DEN units
+  AVFrame* kept_source;
+  AVFrame* kept_scaled;
+  AVFrame* skipped_source; // newest dropped picture, only its timestamps are used
+  int nb_skipped;
 } rescaler_context_t;
 
 AVFrame* allocate_video_frame(enum AVPixelFormat pix_fmt, int width, int height, int pts, int dts) {
@@ -56,47 +72,76 @@ struct SwsContext* allocate_video_scaler(AVCodecContext* codec_context) {
 			SWS_BILINEAR, NULL, NULL, NULL);
 }
 
+void rescale_video_timestamps(rescaler_context_t* rescaler_context, AVFrame* src_avframe,
+			      AVFrame* dst_avframe) {
+  dst_avframe->pts = src_avframe->pts;
+  dst_avframe->pkt_dts = src_avframe->pkt_dts;
+  if (src_avframe->pts != AV_NOPTS_VALUE) {
+    dst_avframe->pts = av_rescale_q(src_avframe->pts, (AVRational){1, DECODER_TIME_BASE_DEN},
+				    rescaler_context->time_base);
+  }
+  if (src_avframe->pkt_dts != AV_NOPTS_VALUE) {
+    dst_avframe->pkt_dts = av_rescale_q(src_avframe->pkt_dts, (AVRational){1, DECODER_TIME_BASE_DEN},
+					rescaler_context->time_base);
+  }
+}
+
+void scale_video_avframe(rescaler_context_t* rescaler_context, AVFrame* src_avframe,
+			 AVFrame* dst_avframe) {
+  rescale_video_timestamps(rescaler_context, src_avframe, dst_avframe);
+  trace_begin("scale", src_avframe->pts);
+
+  int ratio = fastscale_get_ratio(src_avframe->width, src_avframe->height, src_avframe->format,
+				  dst_avframe->width, dst_avframe->height, dst_avframe->format);
+  if (ratio) {
+    fastscale_frame(rescaler_context->fastscale_context, src_avframe, dst_avframe, ratio);
+  } else {
+    // Sources of a concatenation may differ in size and format, every one gets its own scaler
+    rescaler_context->sws_context =
+      sws_getCachedContext(rescaler_context->sws_context, src_avframe->width, src_avframe->height,
+			   src_avframe->format, dst_avframe->width, dst_avframe->height,
+			   dst_avframe->format, SWS_BILINEAR, NULL, NULL, NULL);
+    if (!rescaler_context->sws_context) {
+      throw_error("Could not create a scaler for the source format.", -1);
+    }
+    sws_scale(rescaler_context->sws_context, (const uint8_t* const*)src_avframe->data,
+	      src_avframe->linesize, 0, src_avframe->height, dst_avframe->data, dst_avframe->linesize);
+  }
+  trace_end("scale", TRACE_NO_PTS);
+}
+
 void scale_video_frame(rescaler_context_t* rescaler_context, frame_t* src_frame, frame_t* dst_frame) {
   struct frame_item* src_item = frame_get_item(src_frame);
   struct frame_item* dst_item = frame_get_item(dst_frame);
 
-  AVCodecContext* codec_context = rescaler_context->video_codec_context;
   AVFrame* src_avframe = (AVFrame*)src_item->buffer;
-  AVFrame* dst_avframe = allocate_video_frame(codec_context->pix_fmt,
-					      codec_context->width, codec_context->height,
+  AVFrame* dst_avframe = allocate_video_frame(rescaler_context->pix_fmt,
+					      rescaler_context->width, rescaler_context->height,
 					      src_avframe->pts, src_avframe->pkt_dts);
 
-  if (src_avframe->pts != AV_NOPTS_VALUE) {
-    dst_avframe->pts = av_rescale_q(src_avframe->pts, (AVRational){1, 1000},
-				    codec_context->time_base);
-  }
-  if (src_avframe->pkt_dts != AV_NOPTS_VALUE) {
-    dst_avframe->pkt_dts = av_rescale_q(src_avframe->pkt_dts, (AVRational){1, 1000},
-					codec_context->time_base);
-  }
-
-  sws_scale(rescaler_context->sws_context, (const uint8_t* const*)src_avframe->data,
-	    src_avframe->linesize, 0, src_avframe->height, dst_avframe->data, dst_avframe->linesize);
+  scale_video_avframe(rescaler_context, src_avframe, dst_avframe);
   
   dst_item->stream_id = src_item->stream_id;
   dst_item->buffer = dst_avframe;
 }
 
-void put_video_frame(rescaler_context_t* rescaler_context, frame_t* frame) {
-  if (!rescaler_context->list) {
-    rescaler_context->list = frame; 
-  } else {
-    frame_t* last_frame = frame_last(rescaler_context->list);
-    frame_attach_to(last_frame, frame);
-  }
-}
-
 void rescaler_initialize(rescaler_context_t** rescaler_context, void* codec_context) {
   rescaler_context_t* context = (rescaler_context_t*)malloc(sizeof(rescaler_context_t));
+  AVCodecContext* codec_cxt = (AVCodecContext*)codec_context;
   
-  context->list = NULL;
-  context->video_codec_context = (AVCodecContext*)codec_context;
-  context->sws_context = allocate_video_scaler(codec_context);
+  context->width = codec_cxt->width;
+  context->height = codec_cxt->height;
+  context->pix_fmt = codec_cxt->pix_fmt;
+  context->time_base = codec_cxt->time_base;
+  context->sws_context = allocate_video_scaler(codec_cxt);
+  fastscale_open(&context->fastscale_context);
+
+  context->duplicate_threshold = 0;
+  context->duplicate_keepalive = 0;
+  context->kept_source = NULL;
+  context->kept_scaled = NULL;
+  context->skipped_source = NULL;
+  context->nb_skipped = 0;
 
   *rescaler_context = context;
 }
@@ -104,22 +149,111 @@ void rescaler_initialize(rescaler_context_t** rescaler_context, void* codec_cont
 void rescaler_free(rescaler_context_t** rescaler_context) {
   rescaler_context_t* context = *rescaler_context;
 
-  if (!context->list) {
-    frame_free(&context->list);
-  }
   sws_freeContext(context->sws_context);
+  fastscale_close(&context->fastscale_context);
+  av_frame_free(&context->kept_source);
+  av_frame_free(&context->kept_scaled);
+  av_frame_free(&context->skipped_source);
   free(context);
 
   context = NULL;
 }
 
-void rescaler_put_frame(rescaler_context_t* rescaler_context, frame_t* frame) {
+void rescaler_set_duplicate_detection(rescaler_context_t* rescaler_context, float threshold,
+				     float keepalive) {
+  rescaler_context->duplicate_threshold = threshold;
+  rescaler_context->duplicate_keepalive = (int64_t)(keepalive * DECODER_TIME_BASE_DEN);
+  if (threshold > 0 && !rescaler_context->kept_source) {
+    rescaler_context->kept_source = av_frame_alloc();
+    rescaler_context->kept_scaled = av_frame_alloc();
+    rescaler_context->skipped_source = av_frame_alloc();
+    if (!rescaler_context->kept_source || !rescaler_context->kept_scaled ||
+	!rescaler_context->skipped_source) {
+      throw_error("Error allocating a video frame", -1);
+    }
+  }
+}
+
+int is_duplicate_frame(rescaler_context_t* rescaler_context, AVFrame* avframe) {
+  AVFrame* kept = rescaler_context->kept_source;
+
+  if (rescaler_context->duplicate_threshold <= 0 || !kept || !kept->buf[0]) {
+    return 0;
+  }
+  // A long still picture still gets one every keepalive, seeking and players need them
+  if (avframe->pts == AV_NOPTS_VALUE || kept->pts == AV_NOPTS_VALUE ||
+      avframe->pts - kept->pts >= rescaler_context->duplicate_keepalive) {
+    return 0;
+  }
+  return framediff_is_duplicate(kept, avframe, rescaler_context->duplicate_threshold);
+}
+
+void keep_video_frame(rescaler_context_t* rescaler_context, AVFrame* src_avframe,
+		      AVFrame* dst_avframe) {
+  if (rescaler_context->duplicate_threshold <= 0) {
+    return;
+  }
+
+  av_frame_unref(rescaler_context->kept_source);
+  av_frame_unref(rescaler_context->kept_scaled);
+  av_frame_unref(rescaler_context->skipped_source);
+  if (av_frame_ref(rescaler_context->kept_source, src_avframe) < 0 ||
+      av_frame_ref(rescaler_context->kept_scaled, dst_avframe) < 0) {
+    throw_error("Error referencing a video frame", -1);
+  }
+  rescaler_context->nb_skipped = 0;
+}
+
+frame_t* rescaler_scale_to_frame(rescaler_context_t* rescaler_context, frame_t* frame) {
+  AVFrame* src_avframe = (AVFrame*)frame_get_item(frame)->buffer;
+
+  // Dropped pictures are neither scaled nor encoded, the kept one simply stays on screen longer
+  if (is_duplicate_frame(rescaler_context, src_avframe)) {
+    av_frame_unref(rescaler_context->skipped_source);
+    if (av_frame_ref(rescaler_context->skipped_source, src_avframe) < 0) {
+      throw_error("Error referencing a video frame", -1);
+    }
+    rescaler_context->nb_skipped++;
+    return NULL;
+  }
+
   frame_t* new_frame = frame_alloc(FRAME_VIDEO_TYPE);
+  if (!new_frame) {
+    throw_error("Error allocating a video frame", -1);
+  }
 
+  // scale_video_frame brings its own AVFrame
+  av_frame_free((AVFrame**)&frame_get_item(new_frame)->buffer);
   scale_video_frame(rescaler_context, frame, new_frame);
-  put_video_frame(rescaler_context, new_frame);
+  keep_video_frame(rescaler_context, src_avframe, (AVFrame*)frame_get_item(new_frame)->buffer);
+  return new_frame;
+}
+
+frame_t* rescaler_flush_duplicate(rescaler_context_t* rescaler_context) {
+  if (rescaler_context->nb_skipped == 0) {
+    return NULL;
+  }
+
+  frame_t* new_frame = frame_alloc(FRAME_VIDEO_TYPE);
+  if (!new_frame) {
+    throw_error("Error allocating a video frame", -1);
+  }
+  struct frame_item* item = frame_get_item(new_frame);
+
+  // The kept picture again, sharing its buffers, at the time of the last dropped one
+  if (av_frame_ref((AVFrame*)item->buffer, rescaler_context->kept_scaled) < 0) {
+    throw_error("Error referencing a video frame", -1);
+  }
+  rescale_video_timestamps(rescaler_context, rescaler_context->skipped_source,
+			   (AVFrame*)item->buffer);
+  item->stream_id = FRAME_VIDEO_TYPE;
+
+  av_frame_unref(rescaler_context->skipped_source);
+  rescaler_context->nb_skipped = 0;
+  return new_frame;
 }
 
-frame_t* rescaler_get_frame(rescaler_context_t* rescaler_context) {
-  return rescaler_context->list;
+void rescaler_scale_frame(rescaler_context_t* rescaler_context, frame_t* frame, void* avframe) {
+  struct frame_item* item = frame_get_item(frame);
+  scale_video_avframe(rescaler_context, (AVFrame*)item->buffer, (AVFrame*)avframe);
 }
@@ -8,7 +8,19 @@ typedef struct rescaler_context rescaler_context_t;
 extern void rescaler_initialize(rescaler_context_t** rescaler_context, void* codec_context);
 extern void rescaler_free(rescaler_context_t** rescaler_context);
 
-extern void rescaler_put_frame(rescaler_context_t* rescaler_context, frame_t* frame);
-extern frame_t* rescaler_get_frame(rescaler_context_t* rescaler_context);
+/* Returns a scaled copy of the frame, to be freed by the caller, or NULL when duplicate detection
+   dropped it. */
+extern frame_t* rescaler_scale_to_frame(rescaler_context_t* rescaler_context, frame_t* frame);
+
+/* Pictures within threshold (see framediff_is_duplicate) of the last kept one are dropped by
+   rescaler_scale_to_frame until keepalive seconds have passed since it. 0 turns it off. */
+extern void rescaler_set_duplicate_detection(rescaler_context_t* rescaler_context, float threshold,
+					     float keepalive);
+/* When the last pictures were dropped, returns the kept one again timed as the newest of them so
+   that the output lasts as long as the source. NULL otherwise. */
+extern frame_t* rescaler_flush_duplicate(rescaler_context_t* rescaler_context);
+
+/* Scales straight into a caller owned AVFrame whose format, size and planes are already set. */
+extern void rescaler_scale_frame(rescaler_context_t* rescaler_context, frame_t* frame, void* avframe);
 
 #endif
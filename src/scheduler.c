@@ -0,0 +1,288 @@
+#include "scheduler.h"
+#include "common/error.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define SCHEDULER_DEQUE_INITIAL_CAPACITY 64
+
+struct scheduler_task_item {
+  scheduler_task_t task;
+  void* argument;
+};
+
+/* The owner pushes and pops at the bottom, thieves take the oldest task from the top */
+struct scheduler_deque {
+  pthread_mutex_t mutex;
+  struct scheduler_task_item* items;
+  int capacity;
+  int top;
+  int bottom;
+};
+
+struct scheduler_worker {
+  scheduler_context_t* scheduler_context;
+  pthread_t thread;
+  int index;
+};
+
+typedef struct scheduler_context {
+  int nb_workers;
+  struct scheduler_worker* workers;
+  struct scheduler_deque* deques;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+
+  int queued;     // tasks waiting in the deques
+  int unfinished; // tasks submitted and not finished yet
+  int stopping;
+  int next_deque; // round-robin target for tasks submitted from outside the pool
+  int generation; // bumped once a submitted task is in its deque
+} scheduler_context_t;
+
+static __thread struct scheduler_worker* current_worker = NULL;
+
+static void init_deque(struct scheduler_deque* deque) {
+  pthread_mutex_init(&deque->mutex, NULL);
+  deque->capacity = SCHEDULER_DEQUE_INITIAL_CAPACITY;
+  deque->items = (struct scheduler_task_item*)malloc(deque->capacity * sizeof(struct scheduler_task_item));
+  deque->top = 0;
+  deque->bottom = 0;
+
+  if (!deque->items) {
+    throw_error("Scheduler deque allocation failed.", -1);
+  }
+}
+
+static void free_deque(struct scheduler_deque* deque) {
+  pthread_mutex_destroy(&deque->mutex);
+  free(deque->items);
+}
+
+static void push_bottom(struct scheduler_deque* deque, struct scheduler_task_item item) {
+  pthread_mutex_lock(&deque->mutex);
+
+  if (deque->bottom - deque->top == deque->capacity) {
+    struct scheduler_task_item* items =
+      (struct scheduler_task_item*)malloc(2 * deque->capacity * sizeof(struct scheduler_task_item));
+    if (!items) {
+      throw_error("Scheduler deque allocation failed.", -1);
+    }
+    for (int i = deque->top; i < deque->bottom; i++) {
+      items[i - deque->top] = deque->items[i % deque->capacity];
+    }
+    free(deque->items);
+    deque->items = items;
+    deque->bottom -= deque->top;
+    deque->top = 0;
+    deque->capacity *= 2;
+  }
+
+  deque->items[deque->bottom % deque->capacity] = item;
+  deque->bottom++;
+
+  pthread_mutex_unlock(&deque->mutex);
+}
+
+static int pop_bottom(struct scheduler_deque* deque, struct scheduler_task_item* item) {
+  int found = 0;
+
+  pthread_mutex_lock(&deque->mutex);
+  if (deque->bottom > deque->top) {
+    deque->bottom--;
+    *item = deque->items[deque->bottom % deque->capacity];
+    found = 1;
+  }
+  pthread_mutex_unlock(&deque->mutex);
+
+  return found;
+}
+
+static int steal_top(struct scheduler_deque* deque, struct scheduler_task_item* item, int blocking) {
+  int found = 0;
+
+  if (blocking) {
+    pthread_mutex_lock(&deque->mutex);
+  } else if (pthread_mutex_trylock(&deque->mutex) != 0) {
+    return 0;
+  }
+  if (deque->bottom > deque->top) {
+    *item = deque->items[deque->top % deque->capacity];
+    deque->top++;
+    found = 1;
+  }
+  pthread_mutex_unlock(&deque->mutex);
+
+  return found;
+}
+
+/* The first pass never waits for a busy victim, another one may have work */
+static int find_task(struct scheduler_worker* worker, struct scheduler_task_item* item,
+		     int blocking) {
+  scheduler_context_t* context = worker->scheduler_context;
+
+  if (pop_bottom(&context->deques[worker->index], item)) {
+    return 1;
+  }
+
+  for (int i = 1; i < context->nb_workers; i++) {
+    int victim = (worker->index + i) % context->nb_workers;
+    if (steal_top(&context->deques[victim], item, blocking)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void run_task(scheduler_context_t* context, struct scheduler_task_item* item) {
+  pthread_mutex_lock(&context->mutex);
+  context->queued--;
+  pthread_mutex_unlock(&context->mutex);
+
+  item->task(item->argument);
+
+  pthread_mutex_lock(&context->mutex);
+  if (--context->unfinished == 0) {
+    pthread_cond_broadcast(&context->done_cond);
+  }
+  pthread_mutex_unlock(&context->mutex);
+}
+
+static void* run_worker(void* argument) {
+  struct scheduler_worker* worker = (struct scheduler_worker*)argument;
+  scheduler_context_t* context = worker->scheduler_context;
+  struct scheduler_task_item item;
+
+  current_worker = worker;
+
+  while (1) {
+    if (find_task(worker, &item, 0)) {
+      run_task(context, &item);
+      continue;
+    }
+
+    pthread_mutex_lock(&context->mutex);
+    while (context->queued <= 0 && !context->stopping) {
+      pthread_cond_wait(&context->work_cond, &context->mutex);
+    }
+    if (context->stopping && context->queued <= 0) {
+      pthread_mutex_unlock(&context->mutex);
+      break;
+    }
+    int generation = context->generation;
+    pthread_mutex_unlock(&context->mutex);
+
+    // Tasks are queued but every victim was busy, wait for their locks this time
+    if (find_task(worker, &item, 1)) {
+      run_task(context, &item);
+      continue;
+    }
+
+    // Every deque was seen whole, the queued tasks were taken by workers that have not counted
+    // them yet and anything new comes with a submit
+    pthread_mutex_lock(&context->mutex);
+    while (generation == context->generation && context->queued > 0 && !context->stopping) {
+      pthread_cond_wait(&context->work_cond, &context->mutex);
+    }
+    pthread_mutex_unlock(&context->mutex);
+  }
+
+  return NULL;
+}
+
+void scheduler_open(scheduler_context_t** scheduler_context, int nb_workers) {
+  scheduler_context_t* context = (scheduler_context_t*)malloc(sizeof(scheduler_context_t));
+
+  if (nb_workers < 1) {
+    nb_workers = 1;
+  }
+
+  context->nb_workers = nb_workers;
+  context->workers = (struct scheduler_worker*)malloc(nb_workers * sizeof(struct scheduler_worker));
+  context->deques = (struct scheduler_deque*)malloc(nb_workers * sizeof(struct scheduler_deque));
+  if (!context->workers || !context->deques) {
+    throw_error("Scheduler allocation failed.", -1);
+  }
+
+  pthread_mutex_init(&context->mutex, NULL);
+  pthread_cond_init(&context->work_cond, NULL);
+  pthread_cond_init(&context->done_cond, NULL);
+  context->queued = 0;
+  context->unfinished = 0;
+  context->stopping = 0;
+  context->next_deque = 0;
+  context->generation = 0;
+
+  for (int i = 0; i < nb_workers; i++) {
+    init_deque(&context->deques[i]);
+  }
+
+  for (int i = 0; i < nb_workers; i++) {
+    context->workers[i].scheduler_context = context;
+    context->workers[i].index = i;
+    if (pthread_create(&context->workers[i].thread, NULL, run_worker, &context->workers[i]) != 0) {
+      throw_error("Could not start a scheduler worker.", -1);
+    }
+  }
+
+  *scheduler_context = context;
+}
+
+void scheduler_close(scheduler_context_t** scheduler_context) {
+  scheduler_context_t* context = *scheduler_context;
+
+  pthread_mutex_lock(&context->mutex);
+  context->stopping = 1;
+  pthread_cond_broadcast(&context->work_cond);
+  pthread_mutex_unlock(&context->mutex);
+
+  // Workers still running may try to steal from any deque, none goes before all have stopped
+  for (int i = 0; i < context->nb_workers; i++) {
+    pthread_join(context->workers[i].thread, NULL);
+  }
+  for (int i = 0; i < context->nb_workers; i++) {
+    free_deque(&context->deques[i]);
+  }
+
+  pthread_cond_destroy(&context->done_cond);
+  pthread_cond_destroy(&context->work_cond);
+  pthread_mutex_destroy(&context->mutex);
+  free(context->deques);
+  free(context->workers);
+  free(context);
+
+  *scheduler_context = NULL;
+}
+
+void scheduler_submit(scheduler_context_t* scheduler_context, scheduler_task_t task, void* argument) {
+  struct scheduler_task_item item = { task, argument };
+  int deque_index = 0;
+
+  // Counted before the push so the task can never finish before it is accounted for
+  pthread_mutex_lock(&scheduler_context->mutex);
+  scheduler_context->unfinished++;
+  scheduler_context->queued++;
+  if (current_worker && current_worker->scheduler_context == scheduler_context) {
+    deque_index = current_worker->index;
+  } else {
+    deque_index = scheduler_context->next_deque++ % scheduler_context->nb_workers;
+  }
+  pthread_mutex_unlock(&scheduler_context->mutex);
+
+  push_bottom(&scheduler_context->deques[deque_index], item);
+
+  pthread_mutex_lock(&scheduler_context->mutex);
+  scheduler_context->generation++;
+  pthread_cond_broadcast(&scheduler_context->work_cond);
+  pthread_mutex_unlock(&scheduler_context->mutex);
+}
+
+void scheduler_wait(scheduler_context_t* scheduler_context) {
+  pthread_mutex_lock(&scheduler_context->mutex);
+  while (scheduler_context->unfinished > 0) {
+    pthread_cond_wait(&scheduler_context->done_cond, &scheduler_context->mutex);
+  }
+  pthread_mutex_unlock(&scheduler_context->mutex);
+}
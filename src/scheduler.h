@@ -0,0 +1,18 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+typedef struct scheduler_context scheduler_context_t;
+
+typedef void (*scheduler_task_t)(void* argument);
+
+extern void scheduler_open(scheduler_context_t** scheduler_context, int nb_workers);
+extern void scheduler_close(scheduler_context_t** scheduler_context);
+
+/* Tasks submitted from a worker go to that worker's own deque, idle workers steal them. */
+extern void scheduler_submit(scheduler_context_t* scheduler_context, scheduler_task_t task,
+			     void* argument);
+
+/* Blocks until every submitted task, including the ones they submitted, has finished. */
+extern void scheduler_wait(scheduler_context_t* scheduler_context);
+
+#endif
@@ -0,0 +1,203 @@
+#include "shmoutput.h"
+#include "encoder.h"
+#include "shmring.h"
+#include "common/error.h"
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SHMOUTPUT_PLANE_ALIGNMENT 64
+#define SHMOUTPUT_AUDIO_FRAME_SIZE 1024
+
+typedef struct shmoutput_context {
+  shmring_context_t* shmring_context;
+
+  union {
+    AVCodecContext* codec_context_table[2];
+    struct {
+      AVCodecContext* video_codec_context;
+      AVCodecContext* audio_codec_context;
+    };
+  } media_context;
+
+  // Every video record has the same layout, it is computed once
+  int video_linesize[4];
+  uint32_t video_offset[4];
+  size_t video_size;
+
+  AVFrame* video_avframe; // points into the reserved record
+  struct shmring_frame* video_record;
+} shmoutput_context_t;
+
+static AVCodecContext* allocate_codec_context() {
+  AVCodecContext* codec_context = avcodec_alloc_context3(NULL);
+  if (!codec_context) {
+    throw_error("Shared memory output codec context allocation failed.", -1);
+  }
+  return codec_context;
+}
+
+static void describe_video(shmoutput_context_t* shmoutput_context) {
+  AVCodecContext* codec_context = allocate_codec_context();
+
+  codec_context->codec_type = AVMEDIA_TYPE_VIDEO;
+  codec_context->width = ENCODER_VIDEO_WIDTH;
+  codec_context->height = ENCODER_VIDEO_HEIGHT;
+  codec_context->pix_fmt = AV_PIX_FMT_YUV420P;
+  codec_context->time_base = (AVRational){1, 1000};
+
+  shmoutput_context->media_context.video_codec_context = codec_context;
+}
+
+static void describe_audio(shmoutput_context_t* shmoutput_context) {
+  AVCodecContext* codec_context = allocate_codec_context();
+
+  codec_context->codec_type = AVMEDIA_TYPE_AUDIO;
+  codec_context->sample_fmt = AV_SAMPLE_FMT_FLTP;
+  codec_context->sample_rate = ENCODER_AUDIO_SAMPLE_RATE;
+  codec_context->channel_layout = AV_CH_LAYOUT_STEREO;
+  codec_context->channels = av_get_channel_layout_nb_channels(codec_context->channel_layout);
+  codec_context->frame_size = SHMOUTPUT_AUDIO_FRAME_SIZE;
+  codec_context->time_base = (AVRational){1, ENCODER_AUDIO_SAMPLE_RATE};
+
+  shmoutput_context->media_context.audio_codec_context = codec_context;
+}
+
+/* Planes follow the record header, every row and plane aligned for SIMD loads */
+static void compute_video_layout(shmoutput_context_t* shmoutput_context) {
+  AVCodecContext* codec_context = shmoutput_context->media_context.video_codec_context;
+  const AVPixFmtDescriptor* descriptor = av_pix_fmt_desc_get(codec_context->pix_fmt);
+  int nb_planes = av_pix_fmt_count_planes(codec_context->pix_fmt);
+  size_t offset = SHMRING_ALIGNMENT;
+
+  av_image_fill_linesizes(shmoutput_context->video_linesize, codec_context->pix_fmt,
+			  FFALIGN(codec_context->width, SHMOUTPUT_PLANE_ALIGNMENT));
+
+  for (int i = 0; i < nb_planes; i++) {
+    int height = codec_context->height;
+    if (i == 1 || i == 2) {
+      height = AV_CEIL_RSHIFT(height, descriptor->log2_chroma_h);
+    }
+
+    shmoutput_context->video_offset[i] = (uint32_t)offset;
+    offset += FFALIGN((size_t)shmoutput_context->video_linesize[i] * height,
+		      SHMOUTPUT_PLANE_ALIGNMENT);
+  }
+  shmoutput_context->video_size = offset;
+}
+
+void shmoutput_open(shmoutput_context_t** shmoutput_context, const char* name, size_t capacity) {
+  shmoutput_context_t* context = (shmoutput_context_t*)calloc(1, sizeof(shmoutput_context_t));
+  if (!context) {
+    throw_error("Shared memory output allocation failed.", -1);
+  }
+
+  describe_video(context);
+  describe_audio(context);
+  compute_video_layout(context);
+
+  context->video_avframe = av_frame_alloc();
+  if (!context->video_avframe) {
+    throw_error("Shared memory output frame allocation failed.", -1);
+  }
+
+  shmring_create(&context->shmring_context, name, capacity);
+
+  *shmoutput_context = context;
+}
+
+void shmoutput_close(shmoutput_context_t** shmoutput_context) {
+  shmoutput_context_t* context = *shmoutput_context;
+
+  shmring_close(&context->shmring_context);
+  av_frame_free(&context->video_avframe);
+  avcodec_free_context(&context->media_context.video_codec_context);
+  avcodec_free_context(&context->media_context.audio_codec_context);
+  free(context);
+
+  *shmoutput_context = NULL;
+}
+
+void* shmoutput_get_codec_context(shmoutput_context_t* shmoutput_context, int media_type) {
+  return shmoutput_context->media_context.codec_context_table[media_type];
+}
+
+void* shmoutput_reserve_video_frame(shmoutput_context_t* shmoutput_context) {
+  AVCodecContext* codec_context = shmoutput_context->media_context.video_codec_context;
+  AVFrame* avframe = shmoutput_context->video_avframe;
+
+  struct shmring_frame* record = shmring_reserve(shmoutput_context->shmring_context,
+						 shmoutput_context->video_size);
+  record->type = SHMRING_FRAME_VIDEO;
+  record->time_base_num = codec_context->time_base.num;
+  record->time_base_den = codec_context->time_base.den;
+  record->format = codec_context->pix_fmt;
+  record->width = codec_context->width;
+  record->height = codec_context->height;
+
+  avframe->format = codec_context->pix_fmt;
+  avframe->width = codec_context->width;
+  avframe->height = codec_context->height;
+
+  for (int i = 0; i < 4; i++) {
+    record->linesize[i] = shmoutput_context->video_linesize[i];
+    record->offset[i] = shmoutput_context->video_offset[i];
+
+    avframe->linesize[i] = record->linesize[i];
+    avframe->data[i] = record->offset[i] ? (uint8_t*)record + record->offset[i] : NULL;
+  }
+
+  shmoutput_context->video_record = record;
+  return avframe;
+}
+
+void shmoutput_commit_video_frame(shmoutput_context_t* shmoutput_context) {
+  struct shmring_frame* record = shmoutput_context->video_record;
+
+  record->pts = shmoutput_context->video_avframe->pts;
+  shmring_commit(shmoutput_context->shmring_context, record);
+  shmoutput_context->video_record = NULL;
+}
+
+void shmoutput_put_audio_frame(shmoutput_context_t* shmoutput_context, frame_t* frame) {
+  AVCodecContext* codec_context = shmoutput_context->media_context.audio_codec_context;
+  AVFrame* avframe = (AVFrame*)frame_get_item(frame)->buffer;
+
+  if (avframe->nb_samples <= 0) {
+    return;
+  }
+
+  int planar = av_sample_fmt_is_planar(avframe->format);
+  int nb_planes = planar ? avframe->channels : 1;
+  int plane_size = avframe->nb_samples * av_get_bytes_per_sample(avframe->format) *
+    (planar ? 1 : avframe->channels);
+  int linesize = FFALIGN(plane_size, SHMOUTPUT_PLANE_ALIGNMENT);
+
+  if (nb_planes > 4) {
+    throw_error("Shared memory output supports up to four audio planes.", -1);
+  }
+
+  struct shmring_frame* record = shmring_reserve(shmoutput_context->shmring_context,
+						 SHMRING_ALIGNMENT + (size_t)nb_planes * linesize);
+  record->type = SHMRING_FRAME_AUDIO;
+  record->pts = avframe->pts;
+  record->time_base_num = codec_context->time_base.num;
+  record->time_base_den = codec_context->time_base.den;
+  record->format = avframe->format;
+  record->nb_samples = avframe->nb_samples;
+  record->sample_rate = avframe->sample_rate;
+  record->channels = avframe->channels;
+
+  for (int i = 0; i < nb_planes; i++) {
+    record->linesize[i] = linesize;
+    record->offset[i] = SHMRING_ALIGNMENT + i * linesize;
+    memcpy((uint8_t*)record + record->offset[i], avframe->data[i], plane_size);
+  }
+
+  shmring_commit(shmoutput_context->shmring_context, record);
+}
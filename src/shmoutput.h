@@ -0,0 +1,27 @@
+#ifndef _SHMOUTPUT_H_
+#define _SHMOUTPUT_H_
+
+#include "frame.h"
+
+#include <stddef.h>
+
+typedef struct shmoutput_context shmoutput_context_t;
+
+/*
+ * Publishes raw frames into the shared memory ring called name instead of encoding them:
+ * ENCODER_VIDEO_WIDTH x ENCODER_VIDEO_HEIGHT YUV420P video with millisecond pts and
+ * repacketized FLTP stereo audio at ENCODER_AUDIO_SAMPLE_RATE.
+ */
+extern void shmoutput_open(shmoutput_context_t** shmoutput_context, const char* name, size_t capacity);
+extern void shmoutput_close(shmoutput_context_t** shmoutput_context);
+
+/* Describes the published formats the way encoder_get_codec_context describes the encoded ones. */
+extern void* shmoutput_get_codec_context(shmoutput_context_t* shmoutput_context, int media_type);
+
+/* Returns an AVFrame backed by the next ring record, to be scaled into and then committed. */
+extern void* shmoutput_reserve_video_frame(shmoutput_context_t* shmoutput_context);
+extern void shmoutput_commit_video_frame(shmoutput_context_t* shmoutput_context);
+
+extern void shmoutput_put_audio_frame(shmoutput_context_t* shmoutput_context, frame_t* frame);
+
+#endif
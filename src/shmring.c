@@ -0,0 +1,254 @@
+#include "shmring.h"
+#include "common/error.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+_Static_assert(sizeof(struct shmring_frame) <= SHMRING_ALIGNMENT,
+	       "A padding record has to fit in the smallest gap");
+
+typedef struct shmring_context {
+  int fd;
+  int producer;
+  size_t map_size;
+  struct shmring_header* header;
+  uint8_t* data;
+
+  uint64_t write_offset;    // producer: end of the records reserved so far
+  uint64_t next_offset;     // consumer: record returned by the next call to next
+  uint64_t released_offset; // consumer: end of the records released so far
+} shmring_context_t;
+
+static void futex_wait(uint32_t* word, uint32_t value) {
+  syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+static void futex_wait_timeout(uint32_t* word, uint32_t value, int timeout_ms) {
+  struct timespec timeout = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000 };
+  syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static void futex_wake(uint32_t* word) {
+  syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void signal_word(uint32_t* word) {
+  __atomic_add_fetch(word, 1, __ATOMIC_RELEASE);
+  futex_wake(word);
+}
+
+static size_t align_size(size_t size) {
+  return (size + SHMRING_ALIGNMENT - 1) & ~(size_t)(SHMRING_ALIGNMENT - 1);
+}
+
+static void get_object_name(const char* name, char* buffer, size_t size) {
+  snprintf(buffer, size, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+static void map_object(shmring_context_t* context, int protection) {
+  void* memory = mmap(NULL, context->map_size, protection, MAP_SHARED, context->fd, 0);
+  if (memory == MAP_FAILED) {
+    throw_error("Could not map the shared memory ring.", -1);
+  }
+
+  context->header = (struct shmring_header*)memory;
+  context->data = (uint8_t*)memory + SHMRING_DATA_OFFSET;
+}
+
+static shmring_context_t* allocate_shmring_context() {
+  shmring_context_t* context = (shmring_context_t*)calloc(1, sizeof(shmring_context_t));
+  if (!context) {
+    throw_error("Shared memory ring allocation failed.", -1);
+  }
+  return context;
+}
+
+void shmring_create(shmring_context_t** shmring_context, const char* name, size_t capacity) {
+  shmring_context_t* context = allocate_shmring_context();
+  char object_name[NAME_MAX];
+
+  capacity = align_size(capacity);
+  get_object_name(name, object_name, sizeof(object_name));
+
+  context->fd = shm_open(object_name, O_CREAT | O_TRUNC | O_RDWR, 0600);
+  if (context->fd < 0) {
+    throw_error("Could not create the shared memory ring.", -1);
+  }
+
+  context->producer = 1;
+  context->map_size = SHMRING_DATA_OFFSET + capacity;
+  if (ftruncate(context->fd, (off_t)context->map_size) < 0) {
+    throw_error("Could not size the shared memory ring.", -1);
+  }
+  map_object(context, PROT_READ | PROT_WRITE);
+
+  context->header->capacity = capacity;
+  context->header->version = SHMRING_VERSION;
+  // Written last so a consumer attaching early never sees a half initialized header
+  __atomic_store_n(&context->header->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+
+  *shmring_context = context;
+}
+
+void shmring_attach(shmring_context_t** shmring_context, const char* name) {
+  shmring_context_t* context = allocate_shmring_context();
+  char object_name[NAME_MAX];
+  struct stat info;
+
+  get_object_name(name, object_name, sizeof(object_name));
+
+  context->fd = shm_open(object_name, O_RDWR, 0);
+  if (context->fd < 0 || fstat(context->fd, &info) < 0) {
+    throw_error("Could not open the shared memory ring.", -1);
+  }
+
+  context->map_size = (size_t)info.st_size;
+  if (context->map_size <= SHMRING_DATA_OFFSET) {
+    throw_error("Shared memory ring is not initialized.", -1);
+  }
+  map_object(context, PROT_READ | PROT_WRITE);
+
+  if (__atomic_load_n(&context->header->magic, __ATOMIC_ACQUIRE) != SHMRING_MAGIC ||
+      context->header->version != SHMRING_VERSION) {
+    throw_error("Shared memory ring has an unknown layout.", -1);
+  }
+
+  context->next_offset = __atomic_load_n(&context->header->read_offset, __ATOMIC_ACQUIRE);
+  context->released_offset = context->next_offset;
+  __atomic_store_n(&context->header->consumer_pid, (int32_t)getpid(), __ATOMIC_RELEASE);
+
+  *shmring_context = context;
+}
+
+void shmring_close(shmring_context_t** shmring_context) {
+  shmring_context_t* context = *shmring_context;
+
+  if (context->producer) {
+    __atomic_store_n(&context->header->finished, 1, __ATOMIC_RELEASE);
+    signal_word(&context->header->write_seq);
+  } else {
+    // A producer waiting for room must not wait for a consumer that left
+    __atomic_store_n(&context->header->consumer_pid, -1, __ATOMIC_RELEASE);
+    signal_word(&context->header->read_seq);
+  }
+
+  munmap(context->header, context->map_size);
+  close(context->fd);
+  free(context);
+
+  *shmring_context = NULL;
+}
+
+/* Fails a producer waiting for room that no consumer will ever make, waited_ms so far */
+static void check_consumer(struct shmring_header* header, int waited_ms) {
+  int32_t pid = __atomic_load_n(&header->consumer_pid, __ATOMIC_ACQUIRE);
+
+  if (pid < 0) {
+    throw_error("Shared memory consumer detached before reading every frame.", -1);
+  }
+  if (pid == 0 && waited_ms >= SHMRING_ATTACH_TIMEOUT_MS) {
+    throw_error("No shared memory consumer attached.", -1);
+  }
+  // EPERM still means the process exists
+  if (pid > 0 && kill((pid_t)pid, 0) < 0 && errno == ESRCH) {
+    throw_error("Shared memory consumer died.", -1);
+  }
+}
+
+struct shmring_frame* shmring_reserve(shmring_context_t* shmring_context, size_t size) {
+  struct shmring_header* header = shmring_context->header;
+  uint64_t capacity = header->capacity;
+
+  size = align_size(size);
+  if (size > capacity) {
+    throw_error("Frame does not fit in the shared memory ring.", -1);
+  }
+
+  uint64_t position = shmring_context->write_offset % capacity;
+  uint64_t tail = capacity - position;
+  uint64_t needed = tail < size ? tail + size : size;
+
+  for (int waited_ms = 0;; waited_ms += SHMRING_POLL_INTERVAL_MS) {
+    uint32_t seq = __atomic_load_n(&header->read_seq, __ATOMIC_ACQUIRE);
+    uint64_t read_offset = __atomic_load_n(&header->read_offset, __ATOMIC_ACQUIRE);
+    if (capacity - (shmring_context->write_offset - read_offset) >= needed) {
+      break;
+    }
+    check_consumer(header, waited_ms);
+    futex_wait_timeout(&header->read_seq, seq, SHMRING_POLL_INTERVAL_MS);
+  }
+
+  // Records never wrap, the consumer skips the padding at the end of the data area
+  if (tail < size) {
+    struct shmring_frame* padding = (struct shmring_frame*)(shmring_context->data + position);
+    memset(padding, 0, sizeof(struct shmring_frame));
+    padding->size = (uint32_t)tail;
+    padding->type = SHMRING_FRAME_PADDING;
+    shmring_context->write_offset += tail;
+    position = 0;
+  }
+
+  struct shmring_frame* frame = (struct shmring_frame*)(shmring_context->data + position);
+  memset(frame, 0, sizeof(struct shmring_frame));
+  frame->size = (uint32_t)size;
+  return frame;
+}
+
+void shmring_commit(shmring_context_t* shmring_context, struct shmring_frame* frame) {
+  shmring_context->write_offset += frame->size;
+  __atomic_store_n(&shmring_context->header->write_offset, shmring_context->write_offset,
+		   __ATOMIC_RELEASE);
+  signal_word(&shmring_context->header->write_seq);
+}
+
+const struct shmring_frame* shmring_next(shmring_context_t* shmring_context) {
+  struct shmring_header* header = shmring_context->header;
+
+  while (1) {
+    uint32_t seq = __atomic_load_n(&header->write_seq, __ATOMIC_ACQUIRE);
+    // Loaded before the offset, once it is set the offset read after it is final
+    uint32_t finished = __atomic_load_n(&header->finished, __ATOMIC_ACQUIRE);
+    uint64_t write_offset = __atomic_load_n(&header->write_offset, __ATOMIC_ACQUIRE);
+
+    if (shmring_context->next_offset < write_offset) {
+      const struct shmring_frame* frame = (const struct shmring_frame*)
+	(shmring_context->data + shmring_context->next_offset % header->capacity);
+      shmring_context->next_offset += frame->size;
+      if (frame->type == SHMRING_FRAME_PADDING) {
+	continue;
+      }
+      return frame;
+    }
+
+    if (finished) {
+      return NULL;
+    }
+    futex_wait(&header->write_seq, seq);
+  }
+}
+
+void shmring_release(shmring_context_t* shmring_context, const struct shmring_frame* frame) {
+  struct shmring_header* header = shmring_context->header;
+  const struct shmring_frame* released = NULL;
+
+  // Records are released in order, padding in front of this one goes with it
+  do {
+    released = (const struct shmring_frame*)
+      (shmring_context->data + shmring_context->released_offset % header->capacity);
+    shmring_context->released_offset += released->size;
+  } while (released != frame && released->type == SHMRING_FRAME_PADDING);
+
+  __atomic_store_n(&header->read_offset, shmring_context->released_offset, __ATOMIC_RELEASE);
+  signal_word(&header->read_seq);
+}
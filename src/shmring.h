@@ -0,0 +1,84 @@
+#ifndef _SHMRING_H_
+#define _SHMRING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Single producer, single consumer ring of frames in a POSIX shared memory object.
+ *
+ * The object starts with a struct shmring_header, the data area follows at SHMRING_DATA_OFFSET.
+ * write_offset and read_offset count bytes since the start and only grow, a record starts at
+ * offset % capacity and never wraps: when the tail of the data area is too short the producer
+ * fills it with a SHMRING_FRAME_PADDING record. Plane data of a record is found at
+ * offset[i] bytes from the record itself, so a consumer reads frames in place.
+ *
+ * The producer bumps write_seq and wakes it after every record, the consumer bumps read_seq
+ * and wakes it after releasing records. Both words are meant for FUTEX_WAIT/FUTEX_WAKE
+ * without FUTEX_PRIVATE_FLAG. finished is set once the producer is done. The consumer
+ * unlinks the object when it no longer needs it.
+ *
+ * consumer_pid is 0 until a consumer attaches, its pid then and -1 once it detached. A
+ * producer waiting for room checks it every SHMRING_POLL_INTERVAL_MS and gives up when the
+ * consumer detached or died, or when none attached within SHMRING_ATTACH_TIMEOUT_MS. The pid
+ * is only meaningful when both sides share a pid namespace.
+ */
+
+#define SHMRING_MAGIC 0x48534646 // "FFSH" in memory on little-endian hosts
+#define SHMRING_VERSION 2
+#define SHMRING_ALIGNMENT 128
+#define SHMRING_DATA_OFFSET 4096
+#define SHMRING_POLL_INTERVAL_MS 1000
+#define SHMRING_ATTACH_TIMEOUT_MS 30000
+
+enum shmring_frame_type { SHMRING_FRAME_VIDEO, SHMRING_FRAME_AUDIO, SHMRING_FRAME_PADDING };
+
+struct shmring_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity; // bytes of the data area, a multiple of SHMRING_ALIGNMENT
+
+  uint64_t write_offset;
+  uint64_t read_offset;
+  uint32_t write_seq;
+  uint32_t read_seq;
+  uint32_t finished;
+  int32_t consumer_pid;
+};
+
+struct shmring_frame {
+  uint32_t size; // whole record with its planes, a multiple of SHMRING_ALIGNMENT
+  uint32_t type;
+  int64_t pts;
+  int32_t time_base_num;
+  int32_t time_base_den;
+  int32_t format; // AVPixelFormat or AVSampleFormat
+
+  int32_t width;
+  int32_t height;
+  int32_t nb_samples;
+  int32_t sample_rate;
+  int32_t channels;
+
+  int32_t linesize[4];
+  uint32_t offset[4]; // 0 for unused planes
+};
+
+typedef struct shmring_context shmring_context_t;
+
+/* Producer side, the object is created or truncated to hold capacity bytes of frames. */
+extern void shmring_create(shmring_context_t** shmring_context, const char* name, size_t capacity);
+extern void shmring_close(shmring_context_t** shmring_context);
+
+/* Blocks until size bytes are free and returns the record to fill, published by commit. Fails
+   when the consumer is gone. */
+extern struct shmring_frame* shmring_reserve(shmring_context_t* shmring_context, size_t size);
+extern void shmring_commit(shmring_context_t* shmring_context, struct shmring_frame* frame);
+
+/* Consumer side, next blocks for the following record and returns NULL once the producer
+   finished and everything was read. Records stay valid until they are released. */
+extern void shmring_attach(shmring_context_t** shmring_context, const char* name);
+extern const struct shmring_frame* shmring_next(shmring_context_t* shmring_context);
+extern void shmring_release(shmring_context_t* shmring_context, const struct shmring_frame* frame);
+
+#endif
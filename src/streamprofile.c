@@ -0,0 +1,168 @@
+#include "streamprofile.h"
+#include "cache.h"
+#include "common/error.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define STREAM_PROFILE_STREAM_FIELDS 8 // lines per stream
+
+static const char* const stream_names[] = { "video", "audio" };
+
+struct stream_profile_identity {
+  char input_filename[PATH_MAX];
+  long long size;
+  long long mtime_sec;
+  long mtime_nsec;
+};
+
+static int get_identity(const char* input_filename, struct stream_profile_identity* identity) {
+  struct stat info;
+
+  if (!realpath(input_filename, identity->input_filename) || stat(input_filename, &info) < 0) {
+    return 0;
+  }
+  identity->size = (long long)info.st_size;
+  identity->mtime_sec = (long long)info.st_mtim.tv_sec;
+  identity->mtime_nsec = info.st_mtim.tv_nsec;
+  return 1;
+}
+
+/* FNV-1a of the resolved path, profiles of different files never share a name in practice */
+static void get_profile_filename(const char* directory, const struct stream_profile_identity* identity,
+				 char* buffer, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const char* c = identity->input_filename; *c; c++) {
+    hash = (hash ^ (uint8_t)*c) * 0x100000001b3ULL;
+  }
+  snprintf(buffer, size, "%s/%016llx.profile", directory, (unsigned long long)hash);
+}
+
+static int read_stream_line(const char* line, const char* name, struct stream_profile_stream* stream) {
+  char key[32];
+  size_t length = strlen(name);
+
+  if (strncmp(line, name, length) || line[length] != '_') {
+    return 0;
+  }
+  line += length + 1;
+
+  snprintf(key, sizeof(key), "%.*s", (int)strcspn(line, "="), line);
+  line += strlen(key);
+  if (*line++ != '=') {
+    return 0;
+  }
+
+  if (!strcmp(key, "index")) {
+    return sscanf(line, "%d", &stream->index);
+  } else if (!strcmp(key, "codec")) {
+    return sscanf(line, "%d", &stream->codec_id);
+  } else if (!strcmp(key, "format")) {
+    return sscanf(line, "%d", &stream->format);
+  } else if (!strcmp(key, "size")) {
+    return sscanf(line, "%dx%d", &stream->width, &stream->height) == 2;
+  } else if (!strcmp(key, "sample_rate")) {
+    return sscanf(line, "%d", &stream->sample_rate);
+  } else if (!strcmp(key, "channels")) {
+    return sscanf(line, "%d", &stream->channels);
+  } else if (!strcmp(key, "channel_layout")) {
+    unsigned long long channel_layout = 0;
+    int fields = sscanf(line, "%llu", &channel_layout);
+    stream->channel_layout = channel_layout;
+    return fields;
+  } else if (!strcmp(key, "time_base")) {
+    return sscanf(line, "%d/%d", &stream->time_base_num, &stream->time_base_den) == 2;
+  }
+  return 0;
+}
+
+int stream_profile_load(const char* directory, const char* input_filename,
+			struct stream_profile* profile) {
+  struct stream_profile_identity identity;
+  struct stream_profile_identity stored;
+  char filename[PATH_MAX];
+  char line[PATH_MAX + 32];
+  int fields = 0;
+
+  if (!get_identity(input_filename, &identity)) {
+    return 0;
+  }
+  get_profile_filename(directory, &identity, filename, sizeof(filename));
+
+  FILE* file = fopen(filename, "r");
+  if (!file) {
+    return 0;
+  }
+
+  memset(profile, 0, sizeof(*profile));
+  memset(&stored, 0, sizeof(stored));
+  while (fgets(line, sizeof(line), file)) {
+    line[strcspn(line, "\n")] = '\0';
+    if (!strncmp(line, "input=", 6)) {
+      snprintf(stored.input_filename, sizeof(stored.input_filename), "%s", line + 6);
+      fields++;
+    } else if (!strncmp(line, "format=", 7)) {
+      snprintf(profile->format, sizeof(profile->format), "%s", line + 7);
+      fields++;
+    } else {
+      fields += sscanf(line, "size=%lld", &stored.size);
+      fields += sscanf(line, "mtime=%lld.%ld", &stored.mtime_sec, &stored.mtime_nsec) == 2;
+      for (int i = 0; i < 2; i++) {
+	fields += read_stream_line(line, stream_names[i], &profile->streams[i]);
+      }
+    }
+  }
+  fclose(file);
+
+  // A file rewritten in place may have entirely different streams
+  return fields == 4 + 2 * STREAM_PROFILE_STREAM_FIELDS &&
+    !strcmp(stored.input_filename, identity.input_filename) && stored.size == identity.size &&
+    stored.mtime_sec == identity.mtime_sec && stored.mtime_nsec == identity.mtime_nsec;
+}
+
+/* Jobs on the same input may save at once, the rename keeps readers from a torn profile */
+void stream_profile_save(const char* directory, const char* input_filename,
+			 const struct stream_profile* profile) {
+  struct stream_profile_identity identity;
+  char filename[PATH_MAX];
+  char temp_filename[PATH_MAX];
+
+  if (!get_identity(input_filename, &identity)) {
+    return;
+  }
+  get_profile_filename(directory, &identity, filename, sizeof(filename));
+  cache_get_temp_filename(filename, temp_filename, sizeof(temp_filename));
+
+  FILE* file = fopen(temp_filename, "w");
+  if (!file) {
+    throw_warning("Could not save the stream profile.");
+    return;
+  }
+
+  fprintf(file, "input=%s\n", identity.input_filename);
+  fprintf(file, "size=%lld\n", identity.size);
+  fprintf(file, "mtime=%lld.%09ld\n", identity.mtime_sec, identity.mtime_nsec);
+  fprintf(file, "format=%s\n", profile->format);
+
+  for (int i = 0; i < 2; i++) {
+    const struct stream_profile_stream* stream = &profile->streams[i];
+    const char* name = stream_names[i];
+
+    fprintf(file, "%s_index=%d\n", name, stream->index);
+    fprintf(file, "%s_codec=%d\n", name, stream->codec_id);
+    fprintf(file, "%s_format=%d\n", name, stream->format);
+    fprintf(file, "%s_size=%dx%d\n", name, stream->width, stream->height);
+    fprintf(file, "%s_sample_rate=%d\n", name, stream->sample_rate);
+    fprintf(file, "%s_channels=%d\n", name, stream->channels);
+    fprintf(file, "%s_channel_layout=%llu\n", name, (unsigned long long)stream->channel_layout);
+    fprintf(file, "%s_time_base=%d/%d\n", name, stream->time_base_num, stream->time_base_den);
+  }
+
+  if (fclose(file) != 0 || rename(temp_filename, filename) < 0) {
+    remove(temp_filename);
+    throw_warning("Could not save the stream profile.");
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef _STREAMPROFILE_H_
+#define _STREAMPROFILE_H_
+
+#include <stdint.h>
+
+#define STREAM_PROFILE_FORMAT_SIZE 32
+
+/* What probing found out about one stream, indexed by frame_type. */
+struct stream_profile_stream {
+  int index;
+  int codec_id;
+  int format; // pixel or sample format
+  int width;
+  int height;
+  int sample_rate;
+  int channels;
+  uint64_t channel_layout;
+  int time_base_num;
+  int time_base_den;
+};
+
+struct stream_profile {
+  char format[STREAM_PROFILE_FORMAT_SIZE]; // short name of the demuxer
+  struct stream_profile_stream streams[2];
+};
+
+/*
+ * Profiles live in directory, one per input file, and are only loaded while the file keeps the
+ * size and modification time it had when the profile was saved.
+ */
+extern int stream_profile_load(const char* directory, const char* input_filename,
+			       struct stream_profile* profile);
+extern void stream_profile_save(const char* directory, const char* input_filename,
+				const struct stream_profile* profile);
+
+#endif